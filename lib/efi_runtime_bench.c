@@ -0,0 +1,264 @@
+/*
+ * efi_runtime_bench - variable read throughput with and without libefi_runtime
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libefi_runtime.h"
+
+#define EFI_BUFFER_TOO_SMALL	((1UL << (sizeof(long) * 8 - 1)) | 5)
+
+struct var {
+	efi_guid_t	guid;
+	efi_char16_t	*name;
+};
+
+static struct var *vars;
+static size_t nr_vars, alloc_vars;
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: efi_runtime_bench [-D device] [-n rounds]\n"
+		"\n"
+		"Reads every variable 'rounds' times (default 10), first the way\n"
+		"callers of the raw ioctls usually do, asking for the size and\n"
+		"then reading, then through libefi_runtime.  Only reads.\n"
+		"\n"
+		"  -D device   device node (default "
+		EFI_RUNTIME_DEFAULT_DEVICE ")\n");
+	exit(EXIT_FAILURE);
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t ucs2_size(const efi_char16_t *str)
+{
+	size_t len = sizeof(efi_char16_t);
+
+	while (*str++)
+		len += sizeof(efi_char16_t);
+	return len;
+}
+
+static int collect(const efi_guid_t *guid, const efi_char16_t *name,
+		   void *arg)
+{
+	size_t size = ucs2_size(name);
+	struct var *tmp;
+
+	(void)arg;
+
+	if (nr_vars == alloc_vars) {
+		alloc_vars = alloc_vars ? alloc_vars * 2 : 64;
+		tmp = realloc(vars, alloc_vars * sizeof(*vars));
+		if (!tmp)
+			return -ENOMEM;
+		vars = tmp;
+	}
+
+	vars[nr_vars].guid = *guid;
+	vars[nr_vars].name = malloc(size);
+	if (!vars[nr_vars].name)
+		return -ENOMEM;
+	memcpy(vars[nr_vars].name, name, size);
+	nr_vars++;
+
+	return 0;
+}
+
+/* Size query then read, with a fresh buffer every time */
+static int naive_read(int fd, struct var *var, unsigned long *ioctls)
+{
+	struct efi_getvariable gv;
+	unsigned long size = 0;
+	efi_status_t status;
+	__u32 attr;
+	void *data = NULL;
+	int rv;
+
+	memset(&gv, 0, sizeof(gv));
+	gv.variable_name = var->name;
+	gv.vendor_guid = &var->guid;
+	gv.attributes = &attr;
+	gv.data_size = &size;
+	gv.status = &status;
+
+	for (;;) {
+		gv.data = data;
+		status = 0;
+		(*ioctls)++;
+		rv = ioctl(fd, EFI_RUNTIME_GET_VARIABLE, &gv);
+		if (!rv || status != EFI_BUFFER_TOO_SMALL)
+			break;
+		free(data);
+		data = malloc(size ? size : 1);
+		if (!data)
+			return -ENOMEM;
+	}
+
+	free(data);
+	return rv;
+}
+
+static void report(const char *what, __u64 ns, unsigned long ioctls,
+		   size_t reads, size_t failed)
+{
+	printf("%-24s %10.2f us/read %6.2f ioctls/read %8zu reads",
+	       what, reads ? ns / 1000.0 / reads : 0.0,
+	       reads ? (double)ioctls / reads : 0.0, reads);
+	if (failed)
+		printf(" (%zu failed)", failed);
+	putchar('\n');
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = EFI_RUNTIME_DEFAULT_DEVICE;
+	struct efi_runtime_lib_stats before, after;
+	struct efi_runtime_variable *batch;
+	unsigned int rounds = 10, r, pass;
+	unsigned long ioctls;
+	struct efi_runtime *rt;
+	size_t i, failed, size;
+	void *data;
+	__u64 start;
+	int fd, opt, rv;
+
+	while ((opt = getopt(argc, argv, "D:n:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'n':
+			rounds = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || !rounds)
+		usage();
+
+	rt = efi_runtime_open(device);
+	if (!rt) {
+		perror(device);
+		return EXIT_FAILURE;
+	}
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return EXIT_FAILURE;
+	}
+
+	rv = efi_runtime_for_each_variable(rt, collect, NULL);
+	if (rv) {
+		fprintf(stderr, "enumeration failed: %s\n", strerror(-rv));
+		return EXIT_FAILURE;
+	}
+	printf("%zu variables, %u rounds\n", nr_vars, rounds);
+	if (!nr_vars)
+		return EXIT_SUCCESS;
+
+	/* Raw ioctls */
+	ioctls = failed = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++)
+		for (i = 0; i < nr_vars; i++)
+			if (naive_read(fd, &vars[i], &ioctls))
+				failed++;
+	report("raw ioctls", now_ns() - start, ioctls,
+	       (size_t)rounds * nr_vars, failed);
+
+	/* Library, one round learning the sizes then 'rounds' using them */
+	for (pass = 0; pass < 2; pass++) {
+		unsigned int passes = pass ? rounds : 1;
+
+		efi_runtime_get_stats(rt, &before);
+		failed = 0;
+		start = now_ns();
+		for (r = 0; r < passes; r++) {
+			for (i = 0; i < nr_vars; i++) {
+				if (efi_runtime_get_variable(rt,
+						&vars[i].guid, vars[i].name,
+						NULL, &data, &size)) {
+					failed++;
+					continue;
+				}
+				free(data);
+			}
+		}
+		efi_runtime_get_stats(rt, &after);
+		report(pass ? "library, warm" : "library, cold",
+		       now_ns() - start, after.ioctls - before.ioctls,
+		       (size_t)passes * nr_vars, failed);
+	}
+
+	/* Library, warm, in batches of every variable */
+	batch = calloc(nr_vars, sizeof(*batch));
+	if (!batch) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+	efi_runtime_get_stats(rt, &before);
+	failed = 0;
+	start = now_ns();
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nr_vars; i++) {
+			batch[i].guid = &vars[i].guid;
+			batch[i].name = vars[i].name;
+		}
+		failed += nr_vars - efi_runtime_get_variables(rt, batch,
+							      nr_vars);
+		for (i = 0; i < nr_vars; i++)
+			free(batch[i].data);
+	}
+	efi_runtime_get_stats(rt, &after);
+	report("library, batched", now_ns() - start,
+	       after.ioctls - before.ioctls, (size_t)rounds * nr_vars,
+	       failed);
+
+	printf("size hints: %llu hits, %llu misses, %llu retries\n",
+	       (unsigned long long)after.hint_hits,
+	       (unsigned long long)after.hint_misses,
+	       (unsigned long long)after.retries);
+
+	free(batch);
+	for (i = 0; i < nr_vars; i++)
+		free(vars[i].name);
+	free(vars);
+	close(fd);
+	efi_runtime_close(rt);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,600 @@
+/*
+ * libefi_runtime - client library for /dev/efi_runtime
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libefi_runtime.h"
+
+#define EFI_ERROR_BIT		(1UL << (sizeof(unsigned long) * 8 - 1))
+#define EFI_SUCCESS		0
+#define EFI_INVALID_PARAMETER	(EFI_ERROR_BIT | 2)
+#define EFI_UNSUPPORTED		(EFI_ERROR_BIT | 3)
+#define EFI_BUFFER_TOO_SMALL	(EFI_ERROR_BIT | 5)
+#define EFI_WRITE_PROTECTED	(EFI_ERROR_BIT | 8)
+#define EFI_OUT_OF_RESOURCES	(EFI_ERROR_BIT | 9)
+#define EFI_NOT_FOUND		(EFI_ERROR_BIT | 14)
+#define EFI_SECURITY_VIOLATION	(EFI_ERROR_BIT | 26)
+
+/* Marks a status the driver did not write */
+#define NO_STATUS		((efi_status_t)~0UL)
+
+#define EFI_VARIABLE_APPEND_WRITE	0x40
+
+#define DATA_BUF_MIN		1024
+#define NAME_BUF_MIN		512
+#define GROW_RETRIES		4
+
+#define HINT_BUCKETS		256
+#define HINT_MAX		4096
+
+/* Idle ioctl buffers a handle keeps for reuse */
+#define BUF_POOL		4
+
+struct buf {
+	void		*p;
+	size_t		size;
+};
+
+/* A learned variable size, keyed by (GUID, name) */
+struct hint {
+	struct hint	*next;
+	efi_guid_t	guid;
+	size_t		size;
+	size_t		name_size;
+	efi_char16_t	name[];
+};
+
+/*
+ * 'lock' is only held around the buffer pool, the hint table and the
+ * counters, never across an ioctl.  A call takes a buffer out of the
+ * pool for its ioctls and puts it back when done, so concurrent calls
+ * never share one.
+ */
+struct efi_runtime {
+	int		fd;
+	pthread_mutex_t	lock;
+
+	/* protected by 'lock' */
+	struct buf	pool[BUF_POOL];
+	unsigned int	nr_pool;
+	struct hint	*hints[HINT_BUCKETS];
+	size_t		nr_hints;
+	size_t		name_hint;
+	struct efi_runtime_lib_stats stats;
+};
+
+static size_t ucs2_size(const efi_char16_t *str)
+{
+	size_t len = sizeof(efi_char16_t);
+
+	while (*str++)
+		len += sizeof(efi_char16_t);
+	return len;
+}
+
+efi_char16_t *efi_runtime_ucs2(const char *str, efi_char16_t *buf, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		buf[i] = (unsigned char)str[i];
+		if (!str[i])
+			return buf;
+	}
+	return NULL;
+}
+
+static int efi_errno(efi_status_t status)
+{
+	switch (status) {
+	case EFI_SUCCESS:
+		return 0;
+	case EFI_NOT_FOUND:
+		return -ENOENT;
+	case EFI_BUFFER_TOO_SMALL:
+	case EFI_OUT_OF_RESOURCES:
+		return -ENOSPC;
+	case EFI_WRITE_PROTECTED:
+		return -EROFS;
+	case EFI_SECURITY_VIOLATION:
+		return -EACCES;
+	case EFI_UNSUPPORTED:
+		return -EOPNOTSUPP;
+	case EFI_INVALID_PARAMETER:
+		return -EINVAL;
+	}
+	return -EIO;
+}
+
+static void stats_inc(struct efi_runtime *rt, __u64 *counter)
+{
+	pthread_mutex_lock(&rt->lock);
+	(*counter)++;
+	pthread_mutex_unlock(&rt->lock);
+}
+
+/* Take a buffer from the pool, or an empty one if the pool is empty */
+static void buf_get(struct efi_runtime *rt, struct buf *buf)
+{
+	pthread_mutex_lock(&rt->lock);
+	if (rt->nr_pool) {
+		*buf = rt->pool[--rt->nr_pool];
+	} else {
+		buf->p = NULL;
+		buf->size = 0;
+	}
+	pthread_mutex_unlock(&rt->lock);
+}
+
+/* Return a buffer to the pool, or free it if the pool is full */
+static void buf_put(struct efi_runtime *rt, struct buf *buf)
+{
+	pthread_mutex_lock(&rt->lock);
+	if (buf->p && rt->nr_pool < BUF_POOL) {
+		rt->pool[rt->nr_pool++] = *buf;
+		buf->p = NULL;
+	}
+	pthread_mutex_unlock(&rt->lock);
+
+	free(buf->p);
+}
+
+/* Make 'buf' at least 'size' bytes, keeping its contents */
+static int buf_grow(struct buf *buf, size_t size)
+{
+	void *p;
+
+	if (size <= buf->size)
+		return 0;
+
+	p = realloc(buf->p, size);
+	if (!p)
+		return -ENOMEM;
+	buf->p = p;
+	buf->size = size;
+	return 0;
+}
+
+/* Issue 'cmd' and fold the ioctl and EFI results into one errno */
+static int do_ioctl(struct efi_runtime *rt, unsigned long cmd, void *arg,
+		    efi_status_t *status)
+{
+	int rv;
+
+	*status = NO_STATUS;
+	stats_inc(rt, &rt->stats.ioctls);
+	rv = ioctl(rt->fd, cmd, arg);
+
+	if (*status != NO_STATUS && *status != EFI_SUCCESS)
+		return efi_errno(*status);
+	if (rv < 0)
+		return -errno;
+	return 0;
+}
+
+static unsigned int hint_hash(const efi_guid_t *guid,
+			      const efi_char16_t *name, size_t name_size)
+{
+	const unsigned char *p;
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	size_t i;
+
+	for (p = guid->b, i = 0; i < sizeof(guid->b); i++)
+		h = (h ^ p[i]) * 16777619u;
+	for (p = (const unsigned char *)name, i = 0; i < name_size; i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h % HINT_BUCKETS;
+}
+
+static struct hint **hint_find(struct efi_runtime *rt, const efi_guid_t *guid,
+			       const efi_char16_t *name, size_t name_size)
+{
+	struct hint **pos = &rt->hints[hint_hash(guid, name, name_size)];
+
+	for (; *pos; pos = &(*pos)->next) {
+		if ((*pos)->name_size == name_size &&
+		    !memcmp(&(*pos)->guid, guid, sizeof(*guid)) &&
+		    !memcmp((*pos)->name, name, name_size))
+			break;
+	}
+	return pos;
+}
+
+/* Called with 'lock' held, or on a handle no other thread uses */
+static void hints_free(struct efi_runtime *rt)
+{
+	struct hint *hint, *next;
+	size_t i;
+
+	for (i = 0; i < HINT_BUCKETS; i++) {
+		for (hint = rt->hints[i]; hint; hint = next) {
+			next = hint->next;
+			free(hint);
+		}
+		rt->hints[i] = NULL;
+	}
+	rt->nr_hints = 0;
+}
+
+/* Remember that the variable is 'size' bytes, or forget it if 0 */
+static void hint_set(struct efi_runtime *rt, const efi_guid_t *guid,
+		     const efi_char16_t *name, size_t size)
+{
+	size_t name_size = ucs2_size(name);
+	struct hint **pos, *hint, *new = NULL;
+
+	/* Allocated outside the lock, and freed if not needed */
+	if (size) {
+		new = malloc(sizeof(*new) + name_size);
+		if (new) {
+			new->guid = *guid;
+			new->size = size;
+			new->name_size = name_size;
+			memcpy(new->name, name, name_size);
+			new->next = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&rt->lock);
+	pos = hint_find(rt, guid, name, name_size);
+	hint = *pos;
+
+	if (hint) {
+		if (size) {
+			hint->size = size;
+		} else {
+			*pos = hint->next;
+			free(hint);
+			rt->nr_hints--;
+		}
+	} else if (new) {
+		/* A table this big means names are not being reused */
+		if (rt->nr_hints >= HINT_MAX) {
+			hints_free(rt);
+			pos = hint_find(rt, guid, name, name_size);
+		}
+		*pos = new;
+		rt->nr_hints++;
+		new = NULL;
+	}
+	pthread_mutex_unlock(&rt->lock);
+
+	free(new);
+}
+
+/* The learned size of a variable, 0 if unknown */
+static size_t hint_get(struct efi_runtime *rt, const efi_guid_t *guid,
+		       const efi_char16_t *name)
+{
+	size_t name_size = ucs2_size(name);
+	struct hint *hint;
+	size_t size;
+
+	pthread_mutex_lock(&rt->lock);
+	hint = *hint_find(rt, guid, name, name_size);
+	size = hint ? hint->size : 0;
+	if (size)
+		rt->stats.hint_hits++;
+	else
+		rt->stats.hint_misses++;
+	pthread_mutex_unlock(&rt->lock);
+
+	return size;
+}
+
+/* One GetVariable into 'buf' of *size bytes, learning the size */
+static int get_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			const efi_char16_t *name, __u32 *attributes,
+			void *buf, size_t *size)
+{
+	struct efi_getvariable gv;
+	unsigned long data_size = *size;
+	efi_status_t status;
+	__u32 attr = 0;
+	int rv;
+
+	memset(&gv, 0, sizeof(gv));
+	gv.variable_name = (efi_char16_t *)name;
+	gv.vendor_guid = (efi_guid_t *)guid;
+	gv.attributes = &attr;
+	gv.data_size = &data_size;
+	gv.data = buf;
+	gv.status = &status;
+
+	rv = do_ioctl(rt, EFI_RUNTIME_GET_VARIABLE, &gv, &status);
+	if (!rv || rv == -ENOSPC) {
+		*size = data_size;
+		hint_set(rt, guid, name, data_size);
+	} else if (rv == -ENOENT) {
+		hint_set(rt, guid, name, 0);
+	}
+	if (!rv && attributes)
+		*attributes = attr;
+
+	return rv;
+}
+
+/*
+ * Read a variable into a new buffer returned in *data.  The read goes
+ * into a pooled buffer grown to the learned hint, so a variable no larger
+ * than one read before takes one ioctl even if it was never seen.
+ */
+static int read_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			 const efi_char16_t *name, __u32 *attributes,
+			 void **data, size_t *size)
+{
+	size_t hint = hint_get(rt, guid, name);
+	struct buf buf;
+	int rv, tries;
+
+	buf_get(rt, &buf);
+
+	rv = buf_grow(&buf, hint > DATA_BUF_MIN ? hint : DATA_BUF_MIN);
+	for (tries = 0; !rv && tries < GROW_RETRIES; tries++) {
+		*size = buf.size;
+		rv = get_variable(rt, guid, name, attributes, buf.p, size);
+		if (rv != -ENOSPC)
+			break;
+
+		/* The variable grew, or was never seen */
+		stats_inc(rt, &rt->stats.retries);
+		rv = buf_grow(&buf, *size);
+	}
+	if (!rv && tries == GROW_RETRIES)
+		rv = -ENOSPC;
+
+	if (!rv) {
+		*data = malloc(*size ? *size : 1);
+		if (*data)
+			memcpy(*data, buf.p, *size);
+		else
+			rv = -ENOMEM;
+	}
+
+	buf_put(rt, &buf);
+	return rv;
+}
+
+struct efi_runtime *efi_runtime_open(const char *device)
+{
+	struct efi_runtime *rt;
+
+	rt = calloc(1, sizeof(*rt));
+	if (!rt)
+		return NULL;
+
+	rt->fd = open(device ? device : EFI_RUNTIME_DEFAULT_DEVICE,
+		      O_RDWR | O_CLOEXEC);
+	if (rt->fd < 0) {
+		free(rt);
+		return NULL;
+	}
+	pthread_mutex_init(&rt->lock, NULL);
+	rt->name_hint = NAME_BUF_MIN;
+
+	return rt;
+}
+
+void efi_runtime_close(struct efi_runtime *rt)
+{
+	if (!rt)
+		return;
+
+	close(rt->fd);
+	while (rt->nr_pool)
+		free(rt->pool[--rt->nr_pool].p);
+	hints_free(rt);
+	pthread_mutex_destroy(&rt->lock);
+	free(rt);
+}
+
+int efi_runtime_get_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			     const efi_char16_t *name, __u32 *attributes,
+			     void **data, size_t *size)
+{
+	return read_variable(rt, guid, name, attributes, data, size);
+}
+
+int efi_runtime_get_variable_buf(struct efi_runtime *rt,
+				 const efi_guid_t *guid,
+				 const efi_char16_t *name, __u32 *attributes,
+				 void *buf, size_t *size)
+{
+	return get_variable(rt, guid, name, attributes, buf, size);
+}
+
+int efi_runtime_set_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			     const efi_char16_t *name, __u32 attributes,
+			     const void *data, size_t size)
+{
+	struct efi_setvariable sv;
+	efi_status_t status;
+	int rv;
+
+	memset(&sv, 0, sizeof(sv));
+	sv.variable_name = (efi_char16_t *)name;
+	sv.vendor_guid = (efi_guid_t *)guid;
+	sv.attributes = attributes;
+	sv.data_size = size;
+	sv.data = (void *)data;
+	sv.status = &status;
+
+	rv = do_ioctl(rt, EFI_RUNTIME_SET_VARIABLE, &sv, &status);
+	if (!rv) {
+		/* An append leaves the new size unknown */
+		hint_set(rt, guid, name,
+			 attributes & EFI_VARIABLE_APPEND_WRITE ? 0 : size);
+	}
+
+	return rv;
+}
+
+int efi_runtime_query_variable_info(struct efi_runtime *rt, __u32 attributes,
+				    __u64 *max_storage, __u64 *remaining,
+				    __u64 *max_size)
+{
+	struct efi_queryvariableinfo qvi;
+	efi_status_t status;
+
+	memset(&qvi, 0, sizeof(qvi));
+	qvi.attributes = attributes;
+	qvi.maximum_variable_storage_size = max_storage;
+	qvi.remaining_variable_storage_size = remaining;
+	qvi.maximum_variable_size = max_size;
+	qvi.status = &status;
+
+	return do_ioctl(rt, EFI_RUNTIME_QUERY_VARIABLEINFO, &qvi, &status);
+}
+
+/*
+ * Enumeration takes its name buffer from the pool, grown to the longest
+ * name seen so far.
+ */
+int efi_runtime_for_each_variable(struct efi_runtime *rt,
+				  efi_runtime_variable_fn fn, void *arg)
+{
+	struct efi_getnextvariablename gn;
+	efi_status_t status;
+	efi_guid_t guid;
+	unsigned long name_size;
+	struct buf name;
+	size_t alloc;
+	int rv;
+
+	pthread_mutex_lock(&rt->lock);
+	alloc = rt->name_hint;
+	pthread_mutex_unlock(&rt->lock);
+
+	buf_get(rt, &name);
+	if (buf_grow(&name, alloc)) {
+		buf_put(rt, &name);
+		return -ENOMEM;
+	}
+	/* The first call passes an empty name */
+	memset(name.p, 0, name.size);
+	memset(&guid, 0, sizeof(guid));
+
+	memset(&gn, 0, sizeof(gn));
+	gn.variable_name_size = &name_size;
+	gn.vendor_guid = &guid;
+	gn.status = &status;
+
+	for (;;) {
+		name_size = name.size;
+		gn.variable_name = name.p;
+
+		rv = do_ioctl(rt, EFI_RUNTIME_GET_NEXTVARIABLENAME, &gn,
+			      &status);
+		if (rv == -ENOSPC) {
+			pthread_mutex_lock(&rt->lock);
+			rt->stats.retries++;
+			if (name_size > rt->name_hint)
+				rt->name_hint = name_size;
+			pthread_mutex_unlock(&rt->lock);
+		}
+
+		if (rv == -ENOSPC && name_size > name.size) {
+			/* Keeps the previous name, which firmware needs */
+			alloc = name.size;
+			if (buf_grow(&name, name_size)) {
+				rv = -ENOMEM;
+				break;
+			}
+			memset((char *)name.p + alloc, 0, name.size - alloc);
+			continue;
+		}
+		if (rv == -ENOENT) {
+			rv = 0;
+			break;
+		}
+		if (rv)
+			break;
+
+		rv = fn(&guid, name.p, arg);
+		if (rv)
+			break;
+	}
+
+	buf_put(rt, &name);
+	return rv;
+}
+
+size_t efi_runtime_get_variables(struct efi_runtime *rt,
+				 struct efi_runtime_variable *vars, size_t nr)
+{
+	size_t i, done = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct efi_runtime_variable *var = &vars[i];
+
+		var->data = NULL;
+		var->error = read_variable(rt, var->guid, var->name,
+					   &var->attributes, &var->data,
+					   &var->size);
+		if (!var->error)
+			done++;
+	}
+
+	return done;
+}
+
+size_t efi_runtime_set_variables(struct efi_runtime *rt,
+				 struct efi_runtime_variable *vars, size_t nr)
+{
+	size_t i, done = 0;
+
+	for (i = 0; i < nr; i++) {
+		struct efi_runtime_variable *var = &vars[i];
+
+		var->error = efi_runtime_set_variable(rt, var->guid,
+						      var->name,
+						      var->attributes,
+						      var->data, var->size);
+		if (!var->error)
+			done++;
+	}
+
+	return done;
+}
+
+void efi_runtime_get_stats(struct efi_runtime *rt,
+			   struct efi_runtime_lib_stats *stats)
+{
+	pthread_mutex_lock(&rt->lock);
+	*stats = rt->stats;
+	pthread_mutex_unlock(&rt->lock);
+}
+
+void efi_runtime_reset_hints(struct efi_runtime *rt)
+{
+	pthread_mutex_lock(&rt->lock);
+	hints_free(rt);
+	rt->name_hint = NAME_BUF_MIN;
+	pthread_mutex_unlock(&rt->lock);
+}
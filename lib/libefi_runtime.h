@@ -0,0 +1,138 @@
+/*
+ * libefi_runtime - client library for /dev/efi_runtime
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#ifndef _LIBEFI_RUNTIME_H_
+#define _LIBEFI_RUNTIME_H_
+
+#include <stddef.h>
+
+#include "../src/efi_runtime.h"
+
+#define EFI_RUNTIME_DEFAULT_DEVICE	"/dev/efi_runtime"
+
+/*
+ * A handle on the device.  One handle may be shared by any number of
+ * threads, and their calls run concurrently; the driver answers some
+ * from its caches without entering firmware.
+ *
+ * A handle is one open file, so threads sharing it also share the
+ * driver's per-file scheduling class, weight and deadline, and are not
+ * scheduled fairly against each other.  Threads that should be
+ * scheduled apart must open their own handles.
+ *
+ * The handle keeps a few buffers that calls read into and reuse, one per
+ * call in flight, and learns the size of every variable it reads or
+ * writes.  A read of a known variable, or of one that fits a buffer
+ * already grown by an earlier read, takes one syscall instead of a
+ * BUFFER_TOO_SMALL round trip.
+ */
+struct efi_runtime;
+
+/*
+ * All functions returning int return 0 on success and a negative errno
+ * on failure.  EFI errors are mapped: EFI_NOT_FOUND to -ENOENT,
+ * EFI_BUFFER_TOO_SMALL to -ENOSPC, EFI_OUT_OF_RESOURCES to -ENOSPC,
+ * EFI_WRITE_PROTECTED to -EROFS, EFI_SECURITY_VIOLATION to -EACCES,
+ * EFI_UNSUPPORTED to -EOPNOTSUPP, EFI_INVALID_PARAMETER to -EINVAL and
+ * anything else to -EIO.
+ */
+
+/* Open 'device', or the default device if NULL.  NULL with errno set. */
+struct efi_runtime *efi_runtime_open(const char *device);
+void efi_runtime_close(struct efi_runtime *rt);
+
+/*
+ * Read a variable into a newly allocated buffer returned in *data, which
+ * the caller frees.  'attributes' may be NULL.
+ */
+int efi_runtime_get_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			     const efi_char16_t *name, __u32 *attributes,
+			     void **data, size_t *size);
+
+/*
+ * Read a variable into the caller's buffer of *size bytes.  On -ENOSPC
+ * *size is set to the size the variable needs.
+ */
+int efi_runtime_get_variable_buf(struct efi_runtime *rt,
+				 const efi_guid_t *guid,
+				 const efi_char16_t *name, __u32 *attributes,
+				 void *buf, size_t *size);
+
+/* Write a variable; a 'size' of 0 deletes it */
+int efi_runtime_set_variable(struct efi_runtime *rt, const efi_guid_t *guid,
+			     const efi_char16_t *name, __u32 attributes,
+			     const void *data, size_t size);
+
+int efi_runtime_query_variable_info(struct efi_runtime *rt, __u32 attributes,
+				    __u64 *max_storage, __u64 *remaining,
+				    __u64 *max_size);
+
+/*
+ * Call 'fn' for every variable firmware enumerates.  'name' is only
+ * valid during the call.  Enumeration stops early when 'fn' returns
+ * non-zero, and that value is returned.
+ */
+typedef int (*efi_runtime_variable_fn)(const efi_guid_t *guid,
+				       const efi_char16_t *name, void *arg);
+
+int efi_runtime_for_each_variable(struct efi_runtime *rt,
+				  efi_runtime_variable_fn fn, void *arg);
+
+/*
+ * Batched access: each entry names a variable, and gets its own result
+ * in 'error'.  For reads 'data' is allocated as by
+ * efi_runtime_get_variable().  Return the number of entries that
+ * succeeded.
+ */
+struct efi_runtime_variable {
+	const efi_guid_t	*guid;
+	const efi_char16_t	*name;
+	__u32			attributes;
+	void			*data;
+	size_t			size;
+	int			error;
+};
+
+size_t efi_runtime_get_variables(struct efi_runtime *rt,
+				 struct efi_runtime_variable *vars, size_t nr);
+size_t efi_runtime_set_variables(struct efi_runtime *rt,
+				 struct efi_runtime_variable *vars, size_t nr);
+
+struct efi_runtime_lib_stats {
+	__u64		ioctls;		/* calls made into the driver */
+	__u64		retries;	/* calls repeated after BUFFER_TOO_SMALL */
+	__u64		hint_hits;	/* reads sized from a learned hint */
+	__u64		hint_misses;	/* reads of variables not seen before */
+};
+
+void efi_runtime_get_stats(struct efi_runtime *rt,
+			   struct efi_runtime_lib_stats *stats);
+
+/* Forget all learned variable sizes */
+void efi_runtime_reset_hints(struct efi_runtime *rt);
+
+/*
+ * Convert an ASCII string to UCS-2 in 'buf' of 'nr' characters.
+ * Returns 'buf', or NULL if it is too small.
+ */
+efi_char16_t *efi_runtime_ucs2(const char *str, efi_char16_t *buf, size_t nr);
+
+#endif /* _LIBEFI_RUNTIME_H_ */
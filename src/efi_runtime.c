@@ -26,7 +26,28 @@
 #include <linux/proc_fs.h>
 #include <linux/efi.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/uaccess.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/atomic.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/log2.h>
+#include <linux/kref.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/seq_file.h>
+#include <linux/fs.h>
+#include <linux/sizes.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/capability.h>
 
 #include "efi_runtime.h"
 
@@ -47,282 +68,4476 @@ MODULE_LICENSE("GPL");
 #define ACCESS_OK(type, addr, size)	access_ok(type, addr, size)
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#define KERNEL_READ(file, buf, count, pos)	kernel_read(file, buf, count, pos)
+#else
+#define KERNEL_READ(file, buf, count, pos)				\
+({									\
+	ssize_t __n = kernel_read(file, *(pos), buf, count);		\
+	if (__n > 0)							\
+		*(pos) += __n;						\
+	__n;								\
+})
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 17, 0)
+#define ktime_get_real_seconds()	get_seconds()
+#define mktime64			mktime
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 8, 0)
+#define time64_to_tm			time_to_tm
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 15, 0)
+static inline void kvfree(const void *addr)
+{
+	if (is_vmalloc_addr(addr))
+		vfree(addr);
+	else
+		kfree(addr);
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 5, 0)
+#define GFP_KERNEL_ACCOUNT		GFP_KERNEL
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 12, 0)
+static inline void *kvmalloc(size_t size, gfp_t flags)
+{
+	void *p = NULL;
+
+	if (size <= PAGE_SIZE << PAGE_ALLOC_COSTLY_ORDER)
+		p = kmalloc(size, flags | __GFP_NORETRY | __GFP_NOWARN);
+	return p ? p : __vmalloc(size, flags | __GFP_HIGHMEM, PAGE_KERNEL);
+}
+#endif
+
+/*
+ * Longest ucs2 string accepted from user space, in bytes, and the chunk
+ * it is read in while looking for the terminating NULL.
+ */
+#define UCS2_STRSIZE_MAX	SZ_64K
+#define UCS2_CHUNK		64
+
 /*
  * Count the bytes in 'str', including the terminating NULL.
  *
  * Note this function returns the number of *bytes*, not the number of
- * ucs2 characters.
+ * ucs2 characters.  It returns 0 if 'str' can't be read or isn't
+ * terminated within UCS2_STRSIZE_MAX bytes.
+ *
+ * The string is read a chunk at a time rather than a character at a
+ * time, and a chunk never crosses a page boundary, so a string that ends
+ * right before an unmapped page is still read successfully.
  */
 static inline size_t user_ucs2_strsize(efi_char16_t  __user *str)
 {
-	efi_char16_t *s = str, c;
-	size_t len;
+	efi_char16_t buf[UCS2_CHUNK / sizeof(efi_char16_t)];
+	unsigned long addr = (unsigned long)str;
+	size_t len = 0, chunk, i;
 
 	if (!str)
 		return 0;
 
-	/* Include terminating NULL */
-	len = sizeof(efi_char16_t);
+	while (len < UCS2_STRSIZE_MAX) {
+		chunk = min_t(size_t, UCS2_CHUNK,
+			      PAGE_SIZE - offset_in_page(addr + len));
+		chunk &= ~(sizeof(efi_char16_t) - 1);
+		if (!chunk)
+			/* Odd address, the character straddles two pages */
+			chunk = sizeof(efi_char16_t);
+
+		if (copy_from_user(buf, (u8 __user *)str + len, chunk)) {
+			/* Can't read userspace memory for size */
+			return 0;
+		}
+
+		for (i = 0; i < chunk / sizeof(efi_char16_t); i++) {
+			len += sizeof(efi_char16_t);
+			if (!buf[i])
+				return len;
+		}
+	}
+
+	/* Unterminated */
+	return 0;
+}
+
+/*
+ * Count the bytes in 'str', including the terminating NULL.
+ *
+ * Just a wrap for user_ucs2_strsize
+ */
+static inline int
+get_ucs2_strsize_from_user(efi_char16_t __user *src, size_t *len)
+{
+	if (!src || !ACCESS_OK(VERIFY_READ, src, 1))
+		return -EFAULT;
+
+	*len = user_ucs2_strsize(src);
+	if (*len == 0)
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Copy a ucs2 string to a user buffer.
+ *
+ * This function is a simple wrapper around copy_to_user() that does
+ * nothing if 'src' is NULL, which is useful for reducing the amount of
+ * NULL checking the caller has to do.
+ *
+ * 'len' specifies the number of bytes to copy.  Returns 0 or -EFAULT.
+ */
+static inline int
+copy_ucs2_to_user_len(efi_char16_t __user *dst, efi_char16_t *src, size_t len)
+{
+	if (!src)
+		return 0;
+
+	if (!dst || !ACCESS_OK(VERIFY_WRITE, dst, len))
+		return -EFAULT;
+
+	return copy_to_user(dst, src, len) ? -EFAULT : 0;
+}
+
+/*
+ * A runtime-service call, decoupled from the ioctl that requested it.
+ *
+ * The ioctl handlers marshal the user arguments into one of these,
+ * efi_runtime_dispatch() enters firmware with it and the handlers copy
+ * the results back out.  Optional arguments are passed to firmware only
+ * when their EFI_RUNTIME_ARG_* bit is set in 'args'; 'name' and 'data'
+ * are NULL when absent.  Both buffers are owned by the call.
+ *
+ * Firmware is entered from the driver's worker, and a caller that gives
+ * up waiting leaves the call to finish there, so calls are reference
+ * counted and the buffers are freed with the last reference.
+ */
+struct efi_runtime_call {
+	struct kref		ref;
+	struct efi_runtime_file	*owner;
+	unsigned int		cmd;
+	u32			args;
+	efi_status_t		status;
+
+	efi_char16_t		*name;
+	efi_guid_t		vendor_guid;
+	u32			attributes;
+	unsigned long		size;
+	void			*data;
+	efi_time_t		time;
+	efi_time_cap_t		cap;
+	efi_bool_t		enabled;
+	efi_bool_t		pending;
+	u32			high_count;
+	int			reset_type;
+	efi_status_t		reset_status;
+	u64			max_storage;
+	u64			remaining;
+	u64			max_size;
+
+	/* bytes charged to the owner, see efi_runtime_charge() */
+	size_t			charged;
+
+	/* answered from a cache or buffered, without entering firmware */
+	bool			answered;
+
+	/* firmware worker, see efi_runtime_dispatch() */
+	struct work_struct	work;
+	struct completion	done;
+	atomic_t		state;
+	unsigned long		deadline;
+	u64			firmware_ns;
+
+	/* firmware access scheduling, see efi_sched_acquire() */
+	struct list_head	sched_node;
+	struct completion	sched_done;
+	unsigned int		sched_cost;
+	bool			sched_granted;
+	u64			sched_queued;
+
+	/* call capture, see efi_runtime_trace_args() */
+	u64			trace_start;
+	struct efi_trace_ring	*trace_ring;
+	struct efi_runtime_trace_record *trace_rec;
+};
+
+/*
+ * Per open file state.  Calls hold a reference, as a call abandoned by
+ * its caller can outlive the file.
+ */
+struct efi_runtime_file {
+	struct kref		ref;
+	unsigned int		timeout_ms;
+	atomic_long_t		mem_used;
+
+	/* protected by sched_lock */
+	unsigned int		sched_class;
+	unsigned int		sched_weight;
+	unsigned int		sched_deficit;
+	struct list_head	sched_queue;
+	struct list_head	sched_active;
+	struct efi_runtime_sched_stats sched_stats;
+
+	/* protected by defer_mutex */
+	struct efi_runtime_defer_stats defer_stats;
+	unsigned int		defer_owned;
+	struct delayed_work	defer_work;
+};
+
+#define CALL_ARG(call, arg, ptr) \
+	((call)->args & EFI_RUNTIME_ARG_##arg ? (ptr) : NULL)
+
+/* struct efi_runtime_call.state */
+enum {
+	CALL_IDLE,		/* not handed to the worker */
+	CALL_QUEUED,		/* queued or in firmware */
+	CALL_DONE,		/* firmware returned */
+	CALL_ABANDONED,		/* caller stopped waiting */
+};
+
+static struct kmem_cache *efi_runtime_call_cache;
+
+static void efi_runtime_file_free(struct kref *ref)
+{
+	kfree(container_of(ref, struct efi_runtime_file, ref));
+}
+
+static void efi_runtime_file_put(struct efi_runtime_file *file)
+{
+	kref_put(&file->ref, efi_runtime_file_free);
+}
+
+/*
+ * Call buffers.
+ *
+ * Buffers sized by user space are charged to the calling file, which may
+ * have at most file_mem_max_kb in flight, and to the caller's memory
+ * cgroup.  A buffer over payload_max_kb is refused before anything is
+ * allocated.  Large buffers fall back to vmalloc instead of stalling on
+ * compaction for contiguous pages.
+ */
+static unsigned int payload_max_kb = 1024;
+module_param(payload_max_kb, uint, 0644);
+MODULE_PARM_DESC(payload_max_kb,
+		 "Largest buffer a single call may ask for in KiB");
+
+static unsigned int file_mem_max_kb = 4096;
+module_param(file_mem_max_kb, uint, 0644);
+MODULE_PARM_DESC(file_mem_max_kb,
+		 "Call buffers an open file may have in flight in KiB");
+
+static struct {
+	atomic64_t		allocs;
+	atomic64_t		vmallocs;
+	atomic64_t		oversized;
+	atomic64_t		over_budget;
+	atomic64_t		bytes;
+} mem_stats;
+
+/*
+ * A size module parameter in bytes.  It saturates instead of wrapping
+ * where size_t is 32 bits and the parameter is 4 GiB or more.
+ */
+static size_t efi_kb_to_bytes(unsigned int kb)
+{
+	return min_t(size_t, kb, SIZE_MAX / SZ_1K) * SZ_1K;
+}
+
+static size_t efi_runtime_payload_max(void)
+{
+	return efi_kb_to_bytes(READ_ONCE(payload_max_kb));
+}
+
+/*
+ * Allocate a buffer firmware can be handed.  32-bit firmware under a
+ * 64-bit kernel is given physical addresses, so it only gets physically
+ * contiguous memory.
+ */
+static void *efi_runtime_kvmalloc(size_t size)
+{
+	void *buf;
+
+#if defined(CONFIG_X86_64) && defined(CONFIG_EFI_MIXED)
+	if (!efi_enabled(EFI_64BIT))
+		return kmalloc(size, GFP_KERNEL_ACCOUNT);
+#endif
+	buf = kvmalloc(size, GFP_KERNEL_ACCOUNT);
+	if (buf && is_vmalloc_addr(buf))
+		atomic64_inc(&mem_stats.vmallocs);
+	return buf;
+}
+
+/*
+ * Charge 'size' bytes about to be allocated to 'file'.  Fails with
+ * -E2BIG for a buffer over payload_max_kb and with -ENOBUFS when the
+ * file's budget is spent.
+ */
+static int efi_runtime_file_charge(struct efi_runtime_file *file,
+				   size_t size)
+{
+	long max = min_t(size_t, efi_kb_to_bytes(READ_ONCE(file_mem_max_kb)),
+			 LONG_MAX);
+
+	if (size > efi_runtime_payload_max()) {
+		atomic64_inc(&mem_stats.oversized);
+		return -E2BIG;
+	}
+
+	if (atomic_long_add_return(size, &file->mem_used) > max) {
+		atomic_long_sub(size, &file->mem_used);
+		atomic64_inc(&mem_stats.over_budget);
+		return -ENOBUFS;
+	}
+
+	atomic64_add(size, &mem_stats.bytes);
+
+	return 0;
+}
+
+static void efi_runtime_file_uncharge(struct efi_runtime_file *file,
+				      size_t size)
+{
+	atomic_long_sub(size, &file->mem_used);
+	atomic64_sub(size, &mem_stats.bytes);
+}
+
+/* Charge 'size' bytes about to be allocated for 'call' to its file */
+static int efi_runtime_charge(struct efi_runtime_call *call, size_t size)
+{
+	int rv;
+
+	rv = efi_runtime_file_charge(call->owner, size);
+	if (!rv)
+		call->charged += size;
+
+	return rv;
+}
+
+/* A charged buffer of 'size' bytes for 'call', freed with the call */
+static void *efi_runtime_call_buf(struct efi_runtime_call *call, size_t size)
+{
+	void *buf;
+	int rv;
+
+	rv = efi_runtime_charge(call, size);
+	if (rv)
+		return ERR_PTR(rv);
+
+	buf = efi_runtime_kvmalloc(max_t(size_t, size, 1));
+	if (!buf)
+		return ERR_PTR(-ENOMEM);
+	atomic64_inc(&mem_stats.allocs);
+
+	return buf;
+}
+
+/* As memdup_user(), into a charged buffer */
+static void *efi_runtime_call_buf_user(struct efi_runtime_call *call,
+				       const void __user *src, size_t size)
+{
+	void *buf = efi_runtime_call_buf(call, size);
+
+	if (IS_ERR(buf))
+		return buf;
+
+	if (copy_from_user(buf, src, size)) {
+		kvfree(buf);
+		return ERR_PTR(-EFAULT);
+	}
+	return buf;
+}
+
+static struct efi_runtime_call *
+efi_runtime_call_alloc(struct efi_runtime_file *owner, unsigned int cmd)
+{
+	struct efi_runtime_call *call;
+
+	call = kmem_cache_zalloc(efi_runtime_call_cache, GFP_KERNEL);
+	if (!call)
+		return NULL;
+
+	kref_init(&call->ref);
+	kref_get(&owner->ref);
+	call->owner = owner;
+	call->cmd = cmd;
+	atomic_set(&call->state, CALL_IDLE);
+
+	return call;
+}
+
+static void efi_runtime_call_free(struct kref *ref)
+{
+	struct efi_runtime_call *call;
+
+	call = container_of(ref, struct efi_runtime_call, ref);
+	kvfree(call->name);
+	kvfree(call->data);
+	if (call->charged)
+		efi_runtime_file_uncharge(call->owner, call->charged);
+	efi_runtime_file_put(call->owner);
+	kmem_cache_free(efi_runtime_call_cache, call);
+}
+
+static void efi_runtime_call_put(struct efi_runtime_call *call)
+{
+	kref_put(&call->ref, efi_runtime_call_free);
+}
+
+/*
+ * Results of a call may only be read once firmware has returned and the
+ * worker has published them.
+ */
+static bool efi_runtime_call_done(struct efi_runtime_call *call)
+{
+	return atomic_read(&call->state) == CALL_DONE;
+}
+
+/*
+ * Call capture.
+ *
+ * While enabled, every runtime-service ioctl is recorded in the ring of
+ * the CPU it was dispatched on.  The record is reserved and filled with
+ * the call's inputs just before firmware is entered, since firmware
+ * overwrites several of them, and is committed with status and timing
+ * when the ioctl returns.  read() only ever returns committed records.
+ *
+ * A record never wraps around the end of the ring; when it does not fit
+ * the remaining bytes are skipped, with a padding record if there is
+ * room for a header.
+ */
+#define TRACE_REC_PAD		0x4000
+#define TRACE_REC_PENDING	0x8000
+
+struct efi_trace_ring {
+	spinlock_t		lock;
+	char			*buf;
+	u32			size;
+	u32			head;
+	u32			tail;
+	u32			used;
+};
+
+static unsigned int trace_ring_kb = 256;
+module_param(trace_ring_kb, uint, 0444);
+MODULE_PARM_DESC(trace_ring_kb, "Per-CPU call capture ring size in KiB");
+
+static unsigned int trace_payload_max = 4096;
+module_param(trace_payload_max, uint, 0444);
+MODULE_PARM_DESC(trace_payload_max,
+		 "Bytes of name and of payload kept per captured call, up to 1 MiB");
+
+#define EFI_TRACE_PAYLOAD_MAX	SZ_1M
+
+/* trace_payload_max, bounded and aligned when the rings are allocated */
+static unsigned int trace_payload;
+
+static struct efi_trace_ring __percpu *trace_rings;
+static DEFINE_MUTEX(trace_mutex);
+static bool trace_enabled;
+static atomic64_t trace_seq = ATOMIC64_INIT(0);
+static atomic64_t trace_dropped = ATOMIC64_INIT(0);
+
+static inline size_t trace_record_max(void)
+{
+	return ALIGN(sizeof(struct efi_runtime_trace_record) +
+		     2 * (size_t)trace_payload, 8);
+}
+
+static void efi_runtime_trace_free(void)
+{
+	int cpu;
+
+	if (!trace_rings)
+		return;
+
+	for_each_possible_cpu(cpu)
+		vfree(per_cpu_ptr(trace_rings, cpu)->buf);
+	free_percpu(trace_rings);
+	trace_rings = NULL;
+}
+
+static int efi_runtime_trace_alloc(void)
+{
+	size_t size;
+	int cpu;
+
+	if (trace_rings)
+		return 0;
+
+	trace_payload = ALIGN(min_t(unsigned int, trace_payload_max,
+				    EFI_TRACE_PAYLOAD_MAX),
+			      sizeof(efi_char16_t));
+	size = max_t(size_t, efi_kb_to_bytes(trace_ring_kb),
+		     4 * trace_record_max());
+
+	trace_rings = alloc_percpu(struct efi_trace_ring);
+	if (!trace_rings)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		struct efi_trace_ring *ring = per_cpu_ptr(trace_rings, cpu);
+
+		spin_lock_init(&ring->lock);
+		ring->buf = vmalloc(size);
+		if (!ring->buf) {
+			efi_runtime_trace_free();
+			return -ENOMEM;
+		}
+		ring->size = size;
+	}
+
+	return 0;
+}
+
+static struct efi_runtime_trace_record *
+efi_trace_reserve(struct efi_trace_ring *ring, u32 len, u32 flags)
+{
+	struct efi_runtime_trace_record *rec;
+	u32 pad = 0;
+
+	spin_lock(&ring->lock);
+
+	if (!ring->used)
+		ring->head = ring->tail = 0;
+
+	if (ring->size - ring->head < len)
+		pad = ring->size - ring->head;
+
+	if (ring->used + pad + len > ring->size) {
+		spin_unlock(&ring->lock);
+		return NULL;
+	}
+
+	if (pad >= sizeof(*rec)) {
+		rec = (struct efi_runtime_trace_record *)(ring->buf + ring->head);
+		rec->size = pad;
+		rec->flags = TRACE_REC_PAD;
+	}
+	if (pad)
+		ring->head = 0;
+
+	rec = (struct efi_runtime_trace_record *)(ring->buf + ring->head);
+	rec->size = len;
+	rec->flags = TRACE_REC_PENDING | flags;
+
+	ring->head += len;
+	if (ring->head == ring->size)
+		ring->head = 0;
+	ring->used += pad + len;
+
+	spin_unlock(&ring->lock);
+
+	return rec;
+}
+
+/*
+ * Pop the oldest committed record of 'ring' into 'buf'.  Returns its size,
+ * or 0 if the ring is empty or its oldest record is still in flight.
+ */
+static u32 efi_trace_pop(struct efi_trace_ring *ring, void *buf)
+{
+	struct efi_runtime_trace_record *rec;
+	u32 len = 0;
+
+	spin_lock(&ring->lock);
+
+	while (ring->used) {
+		u32 left = ring->size - ring->tail;
+
+		if (left < sizeof(*rec)) {
+			ring->tail = 0;
+			ring->used -= left;
+			continue;
+		}
+
+		rec = (struct efi_runtime_trace_record *)(ring->buf + ring->tail);
+		if (rec->flags & TRACE_REC_PENDING)
+			break;
+
+		if (!(rec->flags & TRACE_REC_PAD)) {
+			len = rec->size;
+			memcpy(buf, rec, len);
+		}
+
+		ring->tail += rec->size;
+		if (ring->tail == ring->size)
+			ring->tail = 0;
+		ring->used -= rec->size;
+
+		if (len)
+			break;
+	}
+
+	spin_unlock(&ring->lock);
+
+	return len;
+}
+
+static size_t efi_ucs2_size(const efi_char16_t *str, size_t max)
+{
+	size_t len = 0;
+
+	while (len + sizeof(efi_char16_t) <= max) {
+		len += sizeof(efi_char16_t);
+		if (!*str++)
+			break;
+	}
+	return len;
+}
+
+/*
+ * Reserve a record for 'call' and fill in its inputs.  Called right
+ * before firmware is entered, or at commit time for calls that never
+ * got that far.
+ */
+static void efi_runtime_trace_args(struct efi_runtime_call *call)
+{
+	struct efi_runtime_trace_record *rec;
+	struct efi_trace_ring *ring;
+	const void *payload = NULL;
+	size_t name_size = 0, payload_total = 0, payload_size;
+	u32 attributes = call->attributes;
+	char *p;
+
+	if (!call->trace_start || call->trace_rec)
+		return;
+
+	switch (call->cmd) {
+	case EFI_RUNTIME_SET_VARIABLE:
+		payload = call->data;
+		payload_total = call->data ? call->size : 0;
+		break;
+	case EFI_RUNTIME_SET_TIME:
+	case EFI_RUNTIME_SET_WAKETIME:
+		if (call->args & EFI_RUNTIME_ARG_TIME) {
+			payload = &call->time;
+			payload_total = sizeof(efi_time_t);
+		}
+		attributes = call->enabled;
+		break;
+	case EFI_RUNTIME_RESET_SYSTEM:
+		payload = call->data;
+		payload_total = call->data ? call->size : 0;
+		attributes = call->reset_type;
+		break;
+	case EFI_RUNTIME_QUERY_CAPSULECAPABILITIES:
+		payload = call->data;
+		payload_total = call->data ?
+			call->size * sizeof(efi_capsule_header_t) : 0;
+		break;
+	}
+
+	if (call->name)
+		name_size = efi_ucs2_size(call->name, trace_payload);
+	payload_size = min_t(size_t, payload_total, trace_payload);
+
+	ring = raw_cpu_ptr(trace_rings);
+	rec = efi_trace_reserve(ring, ALIGN(sizeof(*rec) + name_size +
+					    payload_size, 8),
+				payload_size < payload_total ?
+				EFI_RUNTIME_TRACE_TRUNCATED : 0);
+	if (!rec) {
+		atomic64_inc(&trace_dropped);
+		return;
+	}
+
+	rec->cmd = call->cmd;
+	rec->seq = atomic64_inc_return(&trace_seq);
+	rec->timestamp_ns = call->trace_start;
+	rec->duration_ns = 0;
+	rec->firmware_ns = 0;
+	rec->status = 0;
+	rec->ret = 0;
+	rec->cpu = raw_smp_processor_id();
+	rec->args = call->args |
+		    (call->name ? EFI_RUNTIME_ARG_NAME : 0) |
+		    (call->data ? EFI_RUNTIME_ARG_DATA : 0);
+	rec->attributes = attributes;
+	rec->size_arg = call->size;
+	rec->vendor_guid = call->vendor_guid;
+	rec->name_size = name_size;
+	rec->payload_size = payload_size;
+	rec->payload_total = payload_total;
+	rec->reserved = 0;
+
+	p = (char *)(rec + 1);
+	memcpy(p, call->name, name_size);
+	memcpy(p + name_size, payload, payload_size);
+
+	call->trace_ring = ring;
+	call->trace_rec = rec;
+}
+
+static void efi_runtime_trace_commit(struct efi_runtime_call *call, long rv)
+{
+	struct efi_runtime_trace_record *rec;
+	bool done;
+
+	if (atomic_read(&call->state) == CALL_IDLE)
+		efi_runtime_trace_args(call);
+
+	rec = call->trace_rec;
+	if (!rec)
+		return;
+
+	done = efi_runtime_call_done(call);
+
+	spin_lock(&call->trace_ring->lock);
+	rec->duration_ns = ktime_get_ns() - call->trace_start;
+	if (done) {
+		rec->firmware_ns = call->firmware_ns;
+		rec->status = call->status;
+		rec->flags |= EFI_RUNTIME_TRACE_DISPATCHED;
+	} else if (call->answered) {
+		rec->status = call->status;
+		rec->flags |= EFI_RUNTIME_TRACE_ANSWERED;
+	}
+	rec->ret = rv;
+	rec->flags &= ~TRACE_REC_PENDING;
+	spin_unlock(&call->trace_ring->lock);
+}
+
+static long efi_runtime_trace_ctl(unsigned long arg)
+{
+	struct efi_runtime_trace_ctl __user *ctl_user;
+	struct efi_runtime_trace_ctl ctl;
+	int rv = 0;
+
+	ctl_user = (struct efi_runtime_trace_ctl __user *)arg;
+	if (copy_from_user(&ctl, ctl_user, sizeof(ctl)))
+		return -EFAULT;
+
+	mutex_lock(&trace_mutex);
+	/* Capture is global, so only an administrator may switch it */
+	if (!!ctl.enable != trace_enabled && !capable(CAP_SYS_ADMIN))
+		rv = -EPERM;
+	else if (ctl.enable)
+		rv = efi_runtime_trace_alloc();
+	if (!rv)
+		WRITE_ONCE(trace_enabled, !!ctl.enable);
+	mutex_unlock(&trace_mutex);
+	if (rv)
+		return rv;
+
+	ctl.payload_max = trace_payload;
+	ctl.records = atomic64_read(&trace_seq);
+	ctl.dropped = atomic64_read(&trace_dropped);
+	if (copy_to_user(ctl_user, &ctl, sizeof(ctl)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Drain captured calls.  Only whole records are returned; the rings are
+ * visited in CPU order, so records are ordered by 'seq' only within a
+ * CPU.  Returns 0 when nothing is ready.
+ */
+static ssize_t efi_runtime_read(struct file *file, char __user *buf,
+				size_t count, loff_t *ppos)
+{
+	size_t done = 0;
+	void *rec;
+	int cpu;
+
+	mutex_lock(&trace_mutex);
+	if (!trace_rings) {
+		mutex_unlock(&trace_mutex);
+		return 0;
+	}
+
+	rec = kmalloc(trace_record_max(), GFP_KERNEL);
+	if (!rec) {
+		mutex_unlock(&trace_mutex);
+		return -ENOMEM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct efi_trace_ring *ring = per_cpu_ptr(trace_rings, cpu);
+		u32 len;
+
+		while (count - done >= trace_record_max()) {
+			len = efi_trace_pop(ring, rec);
+			if (!len)
+				break;
+			if (copy_to_user(buf + done, rec, len)) {
+				kfree(rec);
+				mutex_unlock(&trace_mutex);
+				return done ? done : -EFAULT;
+			}
+			done += len;
+		}
+	}
+
+	kfree(rec);
+	mutex_unlock(&trace_mutex);
+
+	if (!done && count < trace_record_max())
+		return -EINVAL;
+
+	return done;
+}
+
+/*
+ * Wait for 'done' until the call's deadline.  Returns 0 once completed,
+ * -ETIMEDOUT past the deadline or -EINTR if a signal is pending.
+ */
+static int efi_runtime_wait(struct efi_runtime_call *call,
+			    struct completion *done)
+{
+	long left = MAX_SCHEDULE_TIMEOUT;
+
+	if (call->deadline)
+		left = max_t(long, (long)(call->deadline - jiffies), 0);
+
+	left = wait_for_completion_interruptible_timeout(done, left);
+	if (left > 0)
+		return 0;
+
+	return left ? -EINTR : -ETIMEDOUT;
+}
+
+/*
+ * Firmware access scheduling.
+ *
+ * All openers share one firmware and the runtime services run one call
+ * at a time, so callers queue here before entering it.  When firmware is
+ * free a call goes straight through; otherwise it waits on its file's
+ * queue and is granted firmware by the call that releases it.
+ *
+ * Files with waiting calls sit on the active list of their class.
+ * Classes are served in strict priority order and files within a class
+ * by deficit round robin: each visit credits a file weight * quantum
+ * units, and a call is granted once its file has enough credit to cover
+ * its cost.
+ */
+#define EFI_SCHED_CLASSES	(EFI_RUNTIME_SCHED_BULK + 1)
+#define EFI_SCHED_WEIGHT_MAX	256
+
+static unsigned int sched_quantum = 4;
+module_param(sched_quantum, uint, 0644);
+MODULE_PARM_DESC(sched_quantum,
+		 "Round robin credit per visit for a file of weight 1");
+
+static DEFINE_SPINLOCK(sched_lock);
+static struct list_head sched_active[EFI_SCHED_CLASSES];
+static bool sched_busy;
+
+/*
+ * Cost of a call in scheduler units: one for the call, plus one per KiB
+ * of variable data moved.
+ */
+static unsigned int efi_sched_cost(struct efi_runtime_call *call)
+{
+	switch (call->cmd) {
+	case EFI_RUNTIME_GET_VARIABLE:
+	case EFI_RUNTIME_SET_VARIABLE:
+		return 1 + min_t(unsigned long, call->size >> 10, 64);
+	}
+	return 1;
+}
+
+static void efi_sched_account(struct efi_runtime_file *file, u64 wait_ns)
+{
+	struct efi_runtime_sched_stats *stats = &file->sched_stats;
+	u64 wait_us = wait_ns / NSEC_PER_USEC;
+	unsigned int bucket = 0;
+
+	stats->calls++;
+	if (!wait_ns)
+		return;
+
+	stats->queued++;
+	stats->wait_ns += wait_ns;
+	if (wait_ns > stats->max_wait_ns)
+		stats->max_wait_ns = wait_ns;
+
+	if (wait_us)
+		bucket = min_t(unsigned int, ilog2(wait_us) + 1,
+			       ARRAY_SIZE(stats->wait_hist) - 1);
+	stats->wait_hist[bucket]++;
+}
+
+static void efi_sched_dequeue(struct efi_runtime_call *call)
+{
+	struct efi_runtime_file *file = call->owner;
+
+	list_del(&call->sched_node);
+	if (list_empty(&file->sched_queue)) {
+		list_del_init(&file->sched_active);
+		file->sched_deficit = 0;
+	}
+}
+
+static struct efi_runtime_call *efi_sched_pick(void)
+{
+	struct efi_runtime_file *file;
+	struct efi_runtime_call *call;
+	unsigned int class;
+
+	for (class = 0; class < EFI_SCHED_CLASSES; class++) {
+		struct list_head *active = &sched_active[class];
+
+		while (!list_empty(active)) {
+			file = list_first_entry(active, struct efi_runtime_file,
+						sched_active);
+			call = list_first_entry(&file->sched_queue,
+						struct efi_runtime_call,
+						sched_node);
+			if (file->sched_deficit >= call->sched_cost) {
+				file->sched_deficit -= call->sched_cost;
+				efi_sched_dequeue(call);
+				return call;
+			}
+			file->sched_deficit += file->sched_weight *
+					       max(sched_quantum, 1U);
+			list_move_tail(&file->sched_active, active);
+		}
+	}
+
+	return NULL;
+}
+
+static void efi_sched_release(void)
+{
+	struct efi_runtime_call *next;
+
+	spin_lock(&sched_lock);
+	next = efi_sched_pick();
+	if (next) {
+		next->sched_granted = true;
+		efi_sched_account(next->owner,
+				  max_t(u64, ktime_get_ns() - next->sched_queued,
+					1));
+		complete(&next->sched_done);
+	} else {
+		sched_busy = false;
+	}
+	spin_unlock(&sched_lock);
+}
+
+static int efi_sched_acquire(struct efi_runtime_call *call)
+{
+	struct efi_runtime_file *file = call->owner;
+	bool granted;
+	int rv;
+
+	spin_lock(&sched_lock);
+	if (!sched_busy) {
+		sched_busy = true;
+		efi_sched_account(file, 0);
+		spin_unlock(&sched_lock);
+		return 0;
+	}
+
+	call->sched_cost = efi_sched_cost(call);
+	call->sched_granted = false;
+	call->sched_queued = ktime_get_ns();
+	init_completion(&call->sched_done);
+	list_add_tail(&call->sched_node, &file->sched_queue);
+	if (list_empty(&file->sched_active))
+		list_add_tail(&file->sched_active,
+			      &sched_active[file->sched_class]);
+	spin_unlock(&sched_lock);
+
+	rv = efi_runtime_wait(call, &call->sched_done);
+	if (!rv)
+		return 0;
+
+	spin_lock(&sched_lock);
+	granted = call->sched_granted;
+	if (!granted)
+		efi_sched_dequeue(call);
+	spin_unlock(&sched_lock);
+
+	/* Firmware was handed over as the wait ended, pass it on */
+	if (granted)
+		efi_sched_release();
+
+	return rv;
+}
+
+static long efi_runtime_set_sched(struct efi_runtime_file *file,
+				  unsigned long arg)
+{
+	struct efi_runtime_sched sched;
+
+	if (copy_from_user(&sched, (void __user *)arg, sizeof(sched)))
+		return -EFAULT;
+
+	if (sched.sched_class >= EFI_SCHED_CLASSES ||
+	    !sched.weight || sched.weight > EFI_SCHED_WEIGHT_MAX)
+		return -EINVAL;
+
+	/* Strict priority over everyone else is for administrators only */
+	if (sched.sched_class < EFI_RUNTIME_SCHED_NORMAL &&
+	    !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	spin_lock(&sched_lock);
+	if (!list_empty(&file->sched_active))
+		list_move_tail(&file->sched_active,
+			       &sched_active[sched.sched_class]);
+	file->sched_class = sched.sched_class;
+	file->sched_weight = sched.weight;
+	spin_unlock(&sched_lock);
+
+	return 0;
+}
+
+static long efi_runtime_get_sched_stats(struct efi_runtime_file *file,
+					unsigned long arg)
+{
+	struct efi_runtime_sched_stats stats;
+
+	spin_lock(&sched_lock);
+	stats = file->sched_stats;
+	stats.sched_class = file->sched_class;
+	stats.weight = file->sched_weight;
+	spin_unlock(&sched_lock);
+
+	if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * Runtime services backend.  Calls go to firmware through efi.* unless
+ * the module was loaded with backend=emulated.
+ */
+struct efi_runtime_ops {
+	efi_get_time_t			*get_time;
+	efi_set_time_t			*set_time;
+	efi_get_wakeup_time_t		*get_wakeup_time;
+	efi_set_wakeup_time_t		*set_wakeup_time;
+	efi_get_variable_t		*get_variable;
+	efi_get_next_variable_t		*get_next_variable;
+	efi_set_variable_t		*set_variable;
+	efi_get_next_high_mono_count_t	*get_next_high_mono_count;
+	efi_reset_system_t		*reset_system;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	efi_query_variable_info_t	*query_variable_info;
+	efi_query_capsule_caps_t	*query_capsule_caps;
+#endif
+};
+
+static struct efi_runtime_ops efi_firmware_ops;
+static const struct efi_runtime_ops *efi_rt = &efi_firmware_ops;
+
+static void efi_firmware_ops_init(void)
+{
+	efi_firmware_ops.get_time = efi.get_time;
+	efi_firmware_ops.set_time = efi.set_time;
+	efi_firmware_ops.get_wakeup_time = efi.get_wakeup_time;
+	efi_firmware_ops.set_wakeup_time = efi.set_wakeup_time;
+	efi_firmware_ops.get_variable = efi.get_variable;
+	efi_firmware_ops.get_next_variable = efi.get_next_variable;
+	efi_firmware_ops.set_variable = efi.set_variable;
+	efi_firmware_ops.get_next_high_mono_count =
+					efi.get_next_high_mono_count;
+	efi_firmware_ops.reset_system = efi.reset_system;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	efi_firmware_ops.query_variable_info = efi.query_variable_info;
+	efi_firmware_ops.query_capsule_caps = efi.query_capsule_caps;
+#endif
+}
+
+/*
+ * Emulated runtime services.
+ *
+ * With backend=emulated the driver serves the runtime services from an
+ * in-memory variable store instead of firmware, so the interfaces can be
+ * exercised and benchmarked on machines without UEFI.  The store can be
+ * imported from an edk2 variable firmware volume such as OVMF_VARS.fd
+ * (emu_image=) and is exported in the same format through
+ * /proc/efi_runtime/emu_image.
+ *
+ * Variables are accounted the way edk2 lays them out in flash: a write
+ * appends a new copy and marks the old one deleted, and the space of
+ * deleted copies only comes back when a reclaim compacts the store once
+ * it fills up.  QueryVariableInfo reports what edk2 would report for the
+ * same store contents.
+ */
+#define EFI_FVH_SIGNATURE		0x4856465f	/* "_FVH" */
+#define EFI_VARIABLE_DATA		0x55aa
+#define EFI_VARIABLE_STORE_FORMATTED	0x5a
+#define EFI_VARIABLE_STORE_HEALTHY	0xfe
+#define EFI_VAR_IN_DELETED_TRANSITION	0xfe
+#define EFI_VAR_DELETED			0xfd
+#define EFI_VAR_ADDED			0x3f
+#define EFI_EMU_IMAGE_MAX		(64 * SZ_1M)
+
+#define EFI_SYSTEM_NV_DATA_FV_GUID \
+	EFI_GUID(0xfff12b8d, 0x7696, 0x4c8b, \
+		 0xa9, 0x85, 0x27, 0x47, 0x07, 0x5b, 0x4f, 0x50)
+#define EFI_AUTHENTICATED_VARIABLE_GUID \
+	EFI_GUID(0xaaf32c78, 0x947b, 0x439a, \
+		 0xa1, 0x80, 0x2e, 0x14, 0x4e, 0xc3, 0x77, 0x92)
+#define EFI_VARIABLE_STORE_GUID \
+	EFI_GUID(0xddcf3616, 0x3275, 0x4164, \
+		 0x98, 0xb6, 0xfe, 0x85, 0x70, 0x7f, 0xfe, 0x7d)
+
+/* EFI_FIRMWARE_VOLUME_HEADER with a one entry block map */
+struct efi_fv_header {
+	u8			zero_vector[16];
+	efi_guid_t		fs_guid;
+	u64			fv_length;
+	u32			signature;
+	u32			attributes;
+	u16			header_length;
+	u16			checksum;
+	u16			ext_header_offset;
+	u8			reserved;
+	u8			revision;
+	struct {
+		u32		num_blocks;
+		u32		length;
+	} block_map[2];
+} __packed;
+
+/* VARIABLE_STORE_HEADER */
+struct efi_var_store_header {
+	efi_guid_t		signature;
+	u32			size;
+	u8			format;
+	u8			state;
+	u16			reserved;
+	u32			reserved1;
+} __packed;
+
+/* AUTHENTICATED_VARIABLE_HEADER */
+struct efi_auth_var_header {
+	u16			start_id;
+	u8			state;
+	u8			reserved;
+	u32			attributes;
+	u64			monotonic_count;
+	efi_time_t		timestamp;
+	u32			pubkey_index;
+	u32			name_size;
+	u32			data_size;
+	efi_guid_t		vendor_guid;
+} __packed;
+
+/* VARIABLE_HEADER */
+struct efi_var_header {
+	u16			start_id;
+	u8			state;
+	u8			reserved;
+	u32			attributes;
+	u32			name_size;
+	u32			data_size;
+	efi_guid_t		vendor_guid;
+} __packed;
+
+#define EFI_EMU_STORE_START \
+	ALIGN(sizeof(struct efi_var_store_header), 4)
+
+static char *backend = "firmware";
+module_param(backend, charp, 0444);
+MODULE_PARM_DESC(backend, "Runtime services backend: firmware or emulated");
+
+static char *emu_image;
+module_param(emu_image, charp, 0444);
+MODULE_PARM_DESC(emu_image,
+		 "edk2 variable store image to load into the emulated backend");
+
+static unsigned int emu_store_size = 0x40000;
+module_param(emu_store_size, uint, 0444);
+MODULE_PARM_DESC(emu_store_size,
+		 "Size of the emulated variable volume when no image is given");
+
+static unsigned int emu_volatile_size = 0x10000;
+module_param(emu_volatile_size, uint, 0444);
+MODULE_PARM_DESC(emu_volatile_size, "Emulated volatile variable storage");
+
+static unsigned int emu_max_variable_size = 0x2000;
+module_param(emu_max_variable_size, uint, 0444);
+MODULE_PARM_DESC(emu_max_variable_size,
+		 "Emulated maximum variable size, header included");
+
+struct efi_emu_var {
+	struct list_head	node;
+	efi_guid_t		vendor_guid;
+	u32			attributes;
+	u64			monotonic_count;
+	efi_time_t		timestamp;
+	u32			pubkey_index;
+	efi_char16_t		*name;
+	u32			name_size;
+	void			*data;
+	u32			data_size;
+};
+
+static struct {
+	struct mutex		lock;
+	struct list_head	vars;
+	u8			*image;
+	size_t			image_size;
+	u32			store_offset;
+	u32			store_size;
+	bool			authenticated;
+	u32			used;
+	u32			live;
+	u32			volatile_live;
+	u64			reclaims;
+	u64			nv_writes;
+
+	u32			high_count;
+	s64			time_offset;
+	efi_time_t		wakeup_time;
+	efi_bool_t		wakeup_enabled;
+} emu = {
+	.vars = LIST_HEAD_INIT(emu.vars),
+};
+
+static bool efi_runtime_emulated(void)
+{
+	return !strcmp(backend, "emulated");
+}
+
+static size_t efi_emu_header_size(void)
+{
+	return emu.authenticated ? sizeof(struct efi_auth_var_header) :
+				   sizeof(struct efi_var_header);
+}
+
+/* Bytes a variable takes in the store, as edk2 lays it out */
+static u32 efi_emu_var_size(u32 name_size, u32 data_size)
+{
+	return ALIGN(efi_emu_header_size() + name_size + data_size, 4);
+}
+
+static u32 efi_emu_strsize(const efi_char16_t *name)
+{
+	u32 len = sizeof(efi_char16_t);
+
+	while (*name++)
+		len += sizeof(efi_char16_t);
+	return len;
+}
+
+static struct efi_emu_var *efi_emu_find(const efi_guid_t *vendor,
+					const efi_char16_t *name)
+{
+	struct efi_emu_var *var;
+	u32 name_size = efi_emu_strsize(name);
+
+	list_for_each_entry(var, &emu.vars, node) {
+		if (var->name_size == name_size &&
+		    !efi_guidcmp(var->vendor_guid, *vendor) &&
+		    !memcmp(var->name, name, name_size))
+			return var;
+	}
+	return NULL;
+}
+
+static void efi_emu_free_var(struct efi_emu_var *var)
+{
+	list_del(&var->node);
+	kfree(var->name);
+	kfree(var->data);
+	kfree(var);
+}
+
+/* Drop 'var' from the store accounting; its flash copy becomes garbage */
+static void efi_emu_unaccount(struct efi_emu_var *var)
+{
+	u32 size = efi_emu_var_size(var->name_size, var->data_size);
+
+	if (var->attributes & EFI_VARIABLE_NON_VOLATILE)
+		emu.live -= size;
+	else
+		emu.volatile_live -= size;
+}
+
+static void efi_emu_account(struct efi_emu_var *var)
+{
+	u32 size = efi_emu_var_size(var->name_size, var->data_size);
+
+	if (var->attributes & EFI_VARIABLE_NON_VOLATILE)
+		emu.live += size;
+	else
+		emu.volatile_live += size;
+}
+
+/*
+ * Compact the store, as edk2 does when a write no longer fits: only the
+ * live copies are kept.
+ */
+static void efi_emu_reclaim(void)
+{
+	emu.used = EFI_EMU_STORE_START + emu.live;
+	emu.reclaims++;
+}
+
+static int efi_emu_add(const efi_guid_t *vendor, const efi_char16_t *name,
+		       u32 name_size, u32 attributes, const void *data,
+		       u32 data_size, u64 monotonic_count,
+		       const efi_time_t *timestamp, u32 pubkey_index)
+{
+	struct efi_emu_var *var, *old;
+
+	var = kzalloc(sizeof(*var), GFP_KERNEL);
+	if (!var)
+		return -ENOMEM;
+
+	var->name = kmemdup(name, name_size, GFP_KERNEL);
+	var->data = kmalloc(max_t(u32, data_size, 1), GFP_KERNEL);
+	if (!var->name || !var->data) {
+		kfree(var->name);
+		kfree(var->data);
+		kfree(var);
+		return -ENOMEM;
+	}
+	memcpy(var->data, data, data_size);
+
+	var->vendor_guid = *vendor;
+	var->attributes = attributes;
+	var->name_size = name_size;
+	var->data_size = data_size;
+	var->monotonic_count = monotonic_count;
+	var->timestamp = *timestamp;
+	var->pubkey_index = pubkey_index;
+
+	/* A later copy in the store supersedes an earlier one */
+	old = efi_emu_find(vendor, name);
+	if (old) {
+		efi_emu_unaccount(old);
+		efi_emu_free_var(old);
+	}
+
+	list_add_tail(&var->node, &emu.vars);
+	efi_emu_account(var);
+
+	return 0;
+}
+
+/*
+ * Load the variables of an edk2 variable firmware volume.  Only
+ * non-volatile copies in the added state are imported; the store fill
+ * level includes deleted copies, as it would on the machine the image
+ * came from.  A volatile variable found in flash still takes its space
+ * there but doesn't survive the reboot, so it is not loaded.
+ */
+static int efi_emu_import(void)
+{
+	u8 *image = emu.image;
+	size_t size = emu.image_size;
+	const efi_guid_t auth_guid = EFI_AUTHENTICATED_VARIABLE_GUID;
+	const efi_guid_t var_guid = EFI_VARIABLE_STORE_GUID;
+	struct efi_var_store_header *store;
+	struct efi_fv_header *fv;
+	u32 off;
+	int rv;
+
+	fv = (struct efi_fv_header *)image;
+	if (size < sizeof(*fv) || fv->signature != EFI_FVH_SIGNATURE ||
+	    fv->header_length < offsetof(struct efi_fv_header, block_map) ||
+	    fv->header_length + sizeof(*store) > size) {
+		pr_err("efi_runtime: %s is not a firmware volume\n", emu_image);
+		return -EINVAL;
+	}
+
+	store = (struct efi_var_store_header *)(image + fv->header_length);
+	if (!efi_guidcmp(store->signature, auth_guid)) {
+		emu.authenticated = true;
+	} else if (!efi_guidcmp(store->signature, var_guid)) {
+		emu.authenticated = false;
+	} else {
+		pr_err("efi_runtime: %s has no variable store\n", emu_image);
+		return -EINVAL;
+	}
+
+	if (store->format != EFI_VARIABLE_STORE_FORMATTED ||
+	    store->size < EFI_EMU_STORE_START ||
+	    store->size > size - fv->header_length) {
+		pr_err("efi_runtime: %s: bad variable store header\n",
+		       emu_image);
+		return -EINVAL;
+	}
+
+	emu.store_offset = fv->header_length;
+	emu.store_size = store->size;
+
+	off = EFI_EMU_STORE_START;
+	while (off + efi_emu_header_size() <= emu.store_size) {
+		u8 *hdr = (u8 *)store + off;
+		struct efi_auth_var_header *auth = (void *)hdr;
+		struct efi_var_header *plain = (void *)hdr;
+		u32 attributes, name_size, data_size, pubkey_index = 0;
+		u64 monotonic_count = 0;
+		efi_time_t timestamp = {};
+		efi_guid_t vendor;
+		efi_char16_t *name;
+		u8 state;
+
+		if (plain->start_id != EFI_VARIABLE_DATA)
+			break;
+
+		if (emu.authenticated) {
+			state = auth->state;
+			attributes = auth->attributes;
+			name_size = auth->name_size;
+			data_size = auth->data_size;
+			vendor = auth->vendor_guid;
+			monotonic_count = auth->monotonic_count;
+			timestamp = auth->timestamp;
+			pubkey_index = auth->pubkey_index;
+		} else {
+			state = plain->state;
+			attributes = plain->attributes;
+			name_size = plain->name_size;
+			data_size = plain->data_size;
+			vendor = plain->vendor_guid;
+		}
+
+		if (name_size > emu.store_size || data_size > emu.store_size ||
+		    off + efi_emu_header_size() + name_size + data_size >
+		    emu.store_size) {
+			pr_err("efi_runtime: %s: variable at 0x%x overruns the store\n",
+			       emu_image, off);
+			return -EINVAL;
+		}
+
+		name = (efi_char16_t *)(hdr + efi_emu_header_size());
+		if ((state == EFI_VAR_ADDED ||
+		     state == (EFI_VAR_ADDED & EFI_VAR_IN_DELETED_TRANSITION)) &&
+		    (attributes & EFI_VARIABLE_NON_VOLATILE) &&
+		    name_size >= sizeof(efi_char16_t) && !(name_size & 1) &&
+		    !name[name_size / sizeof(efi_char16_t) - 1] &&
+		    efi_emu_strsize(name) == name_size) {
+			rv = efi_emu_add(&vendor, name, name_size, attributes,
+					 (u8 *)name + name_size, data_size,
+					 monotonic_count, &timestamp,
+					 pubkey_index);
+			if (rv)
+				return rv;
+		}
+
+		off += efi_emu_var_size(name_size, data_size);
+	}
+	emu.used = off;
+
+	return 0;
+}
+
+/* Build an empty authenticated variable volume of 'size' bytes */
+static int efi_emu_format(size_t size)
+{
+	struct efi_var_store_header *store;
+	struct efi_fv_header *fv;
+	unsigned int i;
+	u16 sum = 0;
+	u8 *image;
+
+	size = ALIGN(max_t(size_t, size, SZ_4K), SZ_4K);
+	image = vmalloc(size);
+	if (!image)
+		return -ENOMEM;
+	memset(image, 0xff, size);
+
+	fv = (struct efi_fv_header *)image;
+	memset(fv, 0, sizeof(*fv));
+	fv->fs_guid = EFI_SYSTEM_NV_DATA_FV_GUID;
+	fv->fv_length = size;
+	fv->signature = EFI_FVH_SIGNATURE;
+	fv->attributes = 0x4feff;
+	fv->header_length = sizeof(*fv);
+	fv->revision = 2;
+	fv->block_map[0].num_blocks = size / SZ_4K;
+	fv->block_map[0].length = SZ_4K;
+	for (i = 0; i < sizeof(*fv); i += 2)
+		sum += image[i] | image[i + 1] << 8;
+	fv->checksum = -sum;
+
+	store = (struct efi_var_store_header *)(image + sizeof(*fv));
+	memset(store, 0, sizeof(*store));
+	store->signature = EFI_AUTHENTICATED_VARIABLE_GUID;
+	store->size = size - sizeof(*fv);
+	store->format = EFI_VARIABLE_STORE_FORMATTED;
+	store->state = EFI_VARIABLE_STORE_HEALTHY;
+
+	emu.image = image;
+	emu.image_size = size;
+	emu.store_offset = sizeof(*fv);
+	emu.store_size = store->size;
+	emu.authenticated = true;
+	emu.used = EFI_EMU_STORE_START;
+
+	return 0;
+}
+
+/*
+ * Write the current store into 'image', a copy of the loaded volume.
+ * Live non-volatile variables are laid out compactly, as after a reclaim.
+ */
+static void efi_emu_export(u8 *image)
+{
+	struct efi_emu_var *var;
+	u8 *store = image + emu.store_offset;
+	u32 off = EFI_EMU_STORE_START;
+
+	memset(store + off, 0xff, emu.store_size - off);
+
+	list_for_each_entry(var, &emu.vars, node) {
+		u8 *hdr = store + off;
+
+		if (!(var->attributes & EFI_VARIABLE_NON_VOLATILE))
+			continue;
+
+		if (emu.authenticated) {
+			struct efi_auth_var_header *auth = (void *)hdr;
+
+			memset(auth, 0, sizeof(*auth));
+			auth->monotonic_count = var->monotonic_count;
+			auth->timestamp = var->timestamp;
+			auth->pubkey_index = var->pubkey_index;
+			auth->name_size = var->name_size;
+			auth->data_size = var->data_size;
+			auth->vendor_guid = var->vendor_guid;
+		} else {
+			struct efi_var_header *plain = (void *)hdr;
+
+			memset(plain, 0, sizeof(*plain));
+			plain->name_size = var->name_size;
+			plain->data_size = var->data_size;
+			plain->vendor_guid = var->vendor_guid;
+		}
+		((struct efi_var_header *)hdr)->start_id = EFI_VARIABLE_DATA;
+		((struct efi_var_header *)hdr)->state = EFI_VAR_ADDED;
+		((struct efi_var_header *)hdr)->attributes = var->attributes;
+
+		hdr += efi_emu_header_size();
+		memcpy(hdr, var->name, var->name_size);
+		memcpy(hdr + var->name_size, var->data, var->data_size);
+
+		off += efi_emu_var_size(var->name_size, var->data_size);
+	}
+}
+
+static int efi_emu_image_show(struct seq_file *m, void *v)
+{
+	u8 *image;
+
+	image = vmalloc(emu.image_size);
+	if (!image)
+		return -ENOMEM;
+
+	mutex_lock(&emu.lock);
+	memcpy(image, emu.image, emu.image_size);
+	efi_emu_export(image);
+	mutex_unlock(&emu.lock);
+
+	seq_write(m, image, emu.image_size);
+	vfree(image);
+
+	return 0;
+}
+
+static void *efi_emu_read_image(const char *path, size_t *size)
+{
+	struct file *file;
+	loff_t pos = 0, len;
+	ssize_t n;
+	void *buf;
+
+	file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+	if (IS_ERR(file))
+		return ERR_CAST(file);
+
+	len = i_size_read(file_inode(file));
+	if (len <= 0 || len > EFI_EMU_IMAGE_MAX) {
+		buf = ERR_PTR(-EFBIG);
+		goto out;
+	}
+
+	buf = vmalloc(len);
+	if (!buf) {
+		buf = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	while (pos < len) {
+		n = KERNEL_READ(file, buf + pos, len - pos, &pos);
+		if (n <= 0) {
+			vfree(buf);
+			buf = ERR_PTR(n < 0 ? n : -EIO);
+			goto out;
+		}
+	}
+	*size = len;
+out:
+	filp_close(file, NULL);
+	return buf;
+}
+
+static void efi_emu_exit(void)
+{
+	struct efi_emu_var *var, *tmp;
+
+	list_for_each_entry_safe(var, tmp, &emu.vars, node)
+		efi_emu_free_var(var);
+	vfree(emu.image);
+	emu.image = NULL;
+}
+
+static int efi_emu_init(void)
+{
+	size_t size;
+	void *image;
+	int rv;
+
+	mutex_init(&emu.lock);
+
+	if (!emu_image || !*emu_image)
+		return efi_emu_format(emu_store_size);
+
+	image = efi_emu_read_image(emu_image, &size);
+	if (IS_ERR(image)) {
+		pr_err("efi_runtime: can't read %s: %ld\n", emu_image,
+		       PTR_ERR(image));
+		return PTR_ERR(image);
+	}
+
+	emu.image = image;
+	emu.image_size = size;
+	rv = efi_emu_import();
+	if (rv) {
+		efi_emu_exit();
+		return rv;
+	}
+
+	pr_info("efi_runtime: emulating %s, %u of %u store bytes in use\n",
+		emu_image, emu.used, emu.store_size);
+	return 0;
+}
+
+/*
+ * Latency model.  Emulated calls sleep on the firmware worker for the
+ * time the model gives them, so callers see them take as long as calls
+ * into slow firmware would.
+ */
+static unsigned int emu_base_us;
+module_param(emu_base_us, uint, 0444);
+MODULE_PARM_DESC(emu_base_us, "Emulated base cost of every service in us");
+
+static unsigned int emu_per_kb_us;
+module_param(emu_per_kb_us, uint, 0444);
+MODULE_PARM_DESC(emu_per_kb_us,
+		 "Emulated cost per KiB of variable data or name moved in us");
+
+static unsigned int emu_jitter_us;
+module_param(emu_jitter_us, uint, 0444);
+MODULE_PARM_DESC(emu_jitter_us, "Emulated jitter in us");
+
+static unsigned int emu_jitter_dist = EFI_RUNTIME_JITTER_UNIFORM;
+module_param(emu_jitter_dist, uint, 0444);
+MODULE_PARM_DESC(emu_jitter_dist,
+		 "Jitter distribution: 0 none, 1 uniform, 2 normal, 3 exponential");
+
+static unsigned int emu_write_amp_pct = 100;
+module_param(emu_write_amp_pct, uint, 0444);
+MODULE_PARM_DESC(emu_write_amp_pct,
+		 "Emulated flash write amplification in percent");
+
+static unsigned int emu_gc_interval;
+module_param(emu_gc_interval, uint, 0444);
+MODULE_PARM_DESC(emu_gc_interval,
+		 "Stall every this many non-volatile writes, 0 never");
+
+static unsigned int emu_gc_us;
+module_param(emu_gc_us, uint, 0444);
+MODULE_PARM_DESC(emu_gc_us, "Emulated periodic write stall in us");
+
+static unsigned int emu_reclaim_us;
+module_param(emu_reclaim_us, uint, 0444);
+MODULE_PARM_DESC(emu_reclaim_us, "Emulated store reclaim stall in us");
+
+static unsigned int emu_reclaim_per_kb_us;
+module_param(emu_reclaim_per_kb_us, uint, 0444);
+MODULE_PARM_DESC(emu_reclaim_per_kb_us,
+		 "Emulated reclaim cost per KiB of live variables in us");
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 2, 0)
+#define efi_emu_random()		get_random_u32()
+#define efi_emu_random_below(n)		get_random_u32_below(n)
+#else
+#define efi_emu_random()		prandom_u32()
+#define efi_emu_random_below(n)		prandom_u32_max(n)
+#endif
+
+#define EFI_EMU_SVC(cmd)		(_IOC_NR(cmd) - 1)
+
+static DEFINE_SPINLOCK(emu_latency_lock);
+static struct efi_runtime_emu_latency emu_latency;
+
+static struct {
+	atomic64_t		delay_us;
+	atomic64_t		spikes;
+	atomic64_t		gc_stalls;
+	atomic64_t		reclaim_stalls;
+} emu_stats;
+
+static void efi_emu_latency_init(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < EFI_RUNTIME_EMU_SERVICES; i++) {
+		struct efi_runtime_emu_cost *cost = &emu_latency.cost[i];
+
+		cost->base_us = emu_base_us;
+		cost->per_kb_us = emu_per_kb_us;
+		cost->jitter_us = emu_jitter_us;
+		cost->jitter_dist = emu_jitter_dist;
+	}
+	emu_latency.write_amp_pct = emu_write_amp_pct;
+	emu_latency.gc_interval = emu_gc_interval;
+	emu_latency.gc_us = emu_gc_us;
+	emu_latency.reclaim_us = emu_reclaim_us;
+	emu_latency.reclaim_per_kb_us = emu_reclaim_per_kb_us;
+}
+
+/*
+ * -mean * ln(u) for uniform u in (0, 1], with log2 taken in 16.16 fixed
+ * point and linearly interpolated between powers of two; the mean comes
+ * out a few percent high.
+ */
+static u64 efi_emu_exponential(u32 mean)
+{
+	u32 r = efi_emu_random() | 1;
+	int k = ilog2(r);
+	u64 log2_r = ((u64)k << 16) + (((u64)(r - (1U << k)) << 16) >> k);
+	u64 ln = (((32ULL << 16) - log2_r) * 45426) >> 16;	/* ln 2 = 0.6931 */
+
+	return ((u64)mean * ln) >> 16;
+}
+
+static u64 efi_emu_jitter(const struct efi_runtime_emu_cost *cost)
+{
+	u32 j = cost->jitter_us;
+
+	if (!j)
+		return 0;
+
+	switch (cost->jitter_dist) {
+	case EFI_RUNTIME_JITTER_UNIFORM:
+		return efi_emu_random_below(j + 1);
+	case EFI_RUNTIME_JITTER_NORMAL:
+		/* Irwin-Hall, close enough to a bell curve on [0, j] */
+		return efi_emu_random_below(j / 4 + 1) +
+		       efi_emu_random_below(j / 4 + 1) +
+		       efi_emu_random_below(j / 4 + 1) +
+		       efi_emu_random_below(j / 4 + 1);
+	case EFI_RUNTIME_JITTER_EXPONENTIAL:
+		return efi_emu_exponential(j);
+	}
+
+	return 0;
+}
+
+static void efi_emu_delay(u64 us)
+{
+	if (!us)
+		return;
+
+	atomic64_add(us, &emu_stats.delay_us);
+	if (us < 20000)
+		usleep_range(us, us);
+	else
+		msleep(DIV_ROUND_UP_ULL(us, 1000));
+}
+
+/* Spend the modelled time of 'call' on the emulated backend */
+static void efi_emu_call_latency(struct efi_runtime_call *call)
+{
+	struct efi_runtime_emu_cost cost;
+	u32 write_amp_pct;
+	u64 bytes = 0, us;
+
+	switch (call->cmd) {
+	case EFI_RUNTIME_GET_VARIABLE:
+	case EFI_RUNTIME_GET_NEXTVARIABLENAME:
+		if (call->status == EFI_SUCCESS)
+			bytes = call->size;
+		break;
+	case EFI_RUNTIME_SET_VARIABLE:
+		bytes = call->size;
+		if (call->name)
+			bytes += efi_ucs2_size(call->name, SIZE_MAX);
+		break;
+	}
+
+	spin_lock(&emu_latency_lock);
+	cost = emu_latency.cost[EFI_EMU_SVC(call->cmd)];
+	write_amp_pct = emu_latency.write_amp_pct;
+	spin_unlock(&emu_latency_lock);
+
+	if (call->cmd == EFI_RUNTIME_SET_VARIABLE)
+		bytes = div_u64(bytes * write_amp_pct, 100);
+
+	us = cost.base_us + div_u64(bytes * cost.per_kb_us, SZ_1K) +
+	     efi_emu_jitter(&cost);
+	if (cost.spike_permille &&
+	    efi_emu_random_below(1000) < cost.spike_permille) {
+		atomic64_inc(&emu_stats.spikes);
+		us += cost.spike_us;
+	}
+
+	efi_emu_delay(us);
+}
+
+/*
+ * Flash maintenance stalls of a SetVariable that was the 'nv_writes'-th
+ * non-volatile write, and that reclaimed the store moving 'moved' bytes
+ * if 'reclaimed'.
+ */
+static void efi_emu_write_stall(u64 nv_writes, bool reclaimed, u32 moved)
+{
+	u64 us = 0;
+
+	spin_lock(&emu_latency_lock);
+	if (nv_writes && emu_latency.gc_interval &&
+	    !do_div(nv_writes, emu_latency.gc_interval)) {
+		atomic64_inc(&emu_stats.gc_stalls);
+		us += emu_latency.gc_us;
+	}
+	if (reclaimed) {
+		atomic64_inc(&emu_stats.reclaim_stalls);
+		us += emu_latency.reclaim_us +
+		      div_u64((u64)moved * emu_latency.reclaim_per_kb_us,
+			      SZ_1K);
+	}
+	spin_unlock(&emu_latency_lock);
+
+	efi_emu_delay(us);
+}
+
+static long efi_runtime_emu_latency(unsigned int cmd, unsigned long arg)
+{
+	struct efi_runtime_emu_latency __user *ulat;
+	struct efi_runtime_emu_latency lat;
+	unsigned int i;
+
+	if (!efi_runtime_emulated())
+		return -ENODEV;
+
+	ulat = (struct efi_runtime_emu_latency __user *)arg;
+
+	if (cmd == EFI_RUNTIME_GET_EMU_LATENCY) {
+		spin_lock(&emu_latency_lock);
+		lat = emu_latency;
+		spin_unlock(&emu_latency_lock);
+
+		return copy_to_user(ulat, &lat, sizeof(lat)) ? -EFAULT : 0;
+	}
+
+	if (copy_from_user(&lat, ulat, sizeof(lat)))
+		return -EFAULT;
+
+	for (i = 0; i < EFI_RUNTIME_EMU_SERVICES; i++) {
+		if (lat.cost[i].jitter_dist > EFI_RUNTIME_JITTER_EXPONENTIAL ||
+		    lat.cost[i].spike_permille > 1000)
+			return -EINVAL;
+	}
+	if (lat.reserved)
+		return -EINVAL;
+
+	spin_lock(&emu_latency_lock);
+	emu_latency = lat;
+	spin_unlock(&emu_latency_lock);
+
+	return 0;
+}
+
+static efi_status_t efi_emu_get_variable(efi_char16_t *name,
+					 efi_guid_t *vendor, u32 *attr,
+					 unsigned long *data_size, void *data)
+{
+	struct efi_emu_var *var;
+	efi_status_t status;
+
+	if (!name || !vendor || !data_size)
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+
+	var = efi_emu_find(vendor, name);
+	if (!var || !(var->attributes & EFI_VARIABLE_RUNTIME_ACCESS)) {
+		status = EFI_NOT_FOUND;
+	} else if (*data_size < var->data_size) {
+		*data_size = var->data_size;
+		status = EFI_BUFFER_TOO_SMALL;
+	} else if (!data) {
+		status = EFI_INVALID_PARAMETER;
+	} else {
+		memcpy(data, var->data, var->data_size);
+		*data_size = var->data_size;
+		if (attr)
+			*attr = var->attributes;
+		status = EFI_SUCCESS;
+	}
+
+	mutex_unlock(&emu.lock);
+
+	return status;
+}
+
+static efi_status_t efi_emu_get_next_variable(unsigned long *name_size,
+					      efi_char16_t *name,
+					      efi_guid_t *vendor)
+{
+	struct efi_emu_var *var;
+	efi_status_t status = EFI_NOT_FOUND;
+
+	if (!name_size || !name || !vendor)
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+
+	if (!name[0]) {
+		var = list_first_entry(&emu.vars, struct efi_emu_var, node);
+	} else {
+		var = efi_emu_find(vendor, name);
+		if (!var) {
+			status = EFI_INVALID_PARAMETER;
+			goto out;
+		}
+		var = list_next_entry(var, node);
+	}
+
+	for (; &var->node != &emu.vars; var = list_next_entry(var, node)) {
+		if (!(var->attributes & EFI_VARIABLE_RUNTIME_ACCESS))
+			continue;
+
+		if (*name_size < var->name_size) {
+			status = EFI_BUFFER_TOO_SMALL;
+		} else {
+			memcpy(name, var->name, var->name_size);
+			*vendor = var->vendor_guid;
+			status = EFI_SUCCESS;
+		}
+		*name_size = var->name_size;
+		break;
+	}
+
+out:
+	mutex_unlock(&emu.lock);
+
+	return status;
+}
+
+/*
+ * Strip the EFI_VARIABLE_AUTHENTICATION_2 descriptor in front of time
+ * based authenticated data.  Signatures are not checked.
+ */
+static efi_status_t efi_emu_strip_auth(void **data, unsigned long *data_size,
+				       efi_time_t *timestamp)
+{
+	u32 cert_len;
+
+	if (*data_size < sizeof(efi_time_t) + sizeof(u32))
+		return EFI_SECURITY_VIOLATION;
+
+	memcpy(timestamp, *data, sizeof(efi_time_t));
+	memcpy(&cert_len, (u8 *)*data + sizeof(efi_time_t), sizeof(u32));
+	if (cert_len < sizeof(u32) || cert_len > *data_size - sizeof(efi_time_t))
+		return EFI_SECURITY_VIOLATION;
+
+	*data = (u8 *)*data + sizeof(efi_time_t) + cert_len;
+	*data_size -= sizeof(efi_time_t) + cert_len;
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t efi_emu_set_variable(efi_char16_t *name,
+					 efi_guid_t *vendor, u32 attr,
+					 unsigned long data_size, void *data)
+{
+	struct efi_emu_var *var;
+	efi_time_t timestamp = {};
+	efi_status_t status = EFI_SUCCESS;
+	u32 name_size, need, old = 0, access, moved = 0, used = 0;
+	u64 nv_writes = 0;
+	bool nv, reclaimed = false;
+	void *buf = NULL;
+
+	if (!name || !name[0] || !vendor || (data_size && !data))
+		return EFI_INVALID_PARAMETER;
+
+	if (attr & EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS) {
+		status = efi_emu_strip_auth(&data, &data_size, &timestamp);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	name_size = efi_emu_strsize(name);
+	access = EFI_VARIABLE_BOOTSERVICE_ACCESS | EFI_VARIABLE_RUNTIME_ACCESS;
+
+	mutex_lock(&emu.lock);
+
+	var = efi_emu_find(vendor, name);
+
+	/* Delete */
+	if (!(attr & access) ||
+	    (!data_size && !(attr & EFI_VARIABLE_APPEND_WRITE))) {
+		if (!var) {
+			status = EFI_NOT_FOUND;
+		} else {
+			if (var->attributes & EFI_VARIABLE_NON_VOLATILE)
+				nv_writes = ++emu.nv_writes;
+			efi_emu_unaccount(var);
+			efi_emu_free_var(var);
+		}
+		goto out;
+	}
+
+	if ((attr & access) != access ||
+	    (var && (var->attributes ^ attr) & ~EFI_VARIABLE_APPEND_WRITE)) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	if (var && (attr & EFI_VARIABLE_APPEND_WRITE)) {
+		if (!data_size)
+			goto out;
+		buf = kmalloc(var->data_size + data_size, GFP_KERNEL);
+		if (!buf) {
+			status = EFI_OUT_OF_RESOURCES;
+			goto out;
+		}
+		memcpy(buf, var->data, var->data_size);
+		memcpy((u8 *)buf + var->data_size, data, data_size);
+		data = buf;
+		data_size += var->data_size;
+	}
+
+	if (efi_emu_header_size() + name_size + data_size >
+	    emu_max_variable_size) {
+		status = EFI_INVALID_PARAMETER;
+		goto out;
+	}
+
+	nv = attr & EFI_VARIABLE_NON_VOLATILE;
+	need = efi_emu_var_size(name_size, data_size);
+	if (var)
+		old = efi_emu_var_size(var->name_size, var->data_size);
+
+	if (nv) {
+		nv_writes = ++emu.nv_writes;
+		if (emu.used + need > emu.store_size) {
+			efi_emu_reclaim();
+			reclaimed = true;
+			moved = emu.live;
+			if (emu.used - old + need > emu.store_size) {
+				status = EFI_OUT_OF_RESOURCES;
+				goto out;
+			}
+		}
+		/* A reclaim dropped the copy being replaced */
+		used = emu.used - (reclaimed ? old : 0) + need;
+	} else if (emu.volatile_live - old + need > emu_volatile_size) {
+		status = EFI_OUT_OF_RESOURCES;
+		goto out;
+	}
+
+	if (efi_emu_add(vendor, name, name_size,
+			attr & ~EFI_VARIABLE_APPEND_WRITE, data, data_size,
+			var ? var->monotonic_count : 0, &timestamp, 0))
+		status = EFI_OUT_OF_RESOURCES;
+	else if (nv)
+		emu.used = used;
+
+out:
+	mutex_unlock(&emu.lock);
+	kfree(buf);
+
+	efi_emu_write_stall(nv_writes, reclaimed, moved);
+
+	return status;
+}
+
+static efi_status_t efi_emu_query_variable_info(u32 attr, u64 *storage,
+						u64 *remaining,
+						u64 *max_size)
+{
+	if (!(attr & EFI_VARIABLE_BOOTSERVICE_ACCESS) ||
+	    !(attr & EFI_VARIABLE_RUNTIME_ACCESS))
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+
+	if (attr & EFI_VARIABLE_NON_VOLATILE) {
+		*storage = emu.store_size - sizeof(struct efi_var_store_header);
+		/* As edk2 at runtime, deleted copies count until a reclaim */
+		*remaining = emu.store_size - emu.used;
+	} else {
+		*storage = emu_volatile_size;
+		*remaining = emu_volatile_size - emu.volatile_live;
+	}
+	*max_size = emu_max_variable_size - efi_emu_header_size();
+
+	mutex_unlock(&emu.lock);
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t efi_emu_get_time(efi_time_t *tm, efi_time_cap_t *tc)
+{
+	struct tm t;
+
+	if (!tm)
+		return EFI_INVALID_PARAMETER;
+
+	time64_to_tm(ktime_get_real_seconds() + READ_ONCE(emu.time_offset),
+		     0, &t);
+
+	memset(tm, 0, sizeof(*tm));
+	tm->year = t.tm_year + 1900;
+	tm->month = t.tm_mon + 1;
+	tm->day = t.tm_mday;
+	tm->hour = t.tm_hour;
+	tm->minute = t.tm_min;
+	tm->second = t.tm_sec;
+	tm->timezone = 0x7ff;	/* EFI_UNSPECIFIED_TIMEZONE */
+
+	if (tc) {
+		tc->resolution = 1;
+		tc->accuracy = 50000000;
+		tc->sets_to_zero = 0;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static bool efi_emu_valid_time(const efi_time_t *tm)
+{
+	return tm->year >= 1900 && tm->year <= 9999 &&
+	       tm->month >= 1 && tm->month <= 12 &&
+	       tm->day >= 1 && tm->day <= 31 &&
+	       tm->hour <= 23 && tm->minute <= 59 && tm->second <= 59 &&
+	       tm->nanosecond <= 999999999;
+}
+
+static efi_status_t efi_emu_set_time(efi_time_t *tm)
+{
+	if (!tm || !efi_emu_valid_time(tm))
+		return EFI_INVALID_PARAMETER;
+
+	WRITE_ONCE(emu.time_offset,
+		   mktime64(tm->year, tm->month, tm->day, tm->hour,
+			    tm->minute, tm->second) -
+		   ktime_get_real_seconds());
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t efi_emu_get_wakeup_time(efi_bool_t *enabled,
+					    efi_bool_t *pending,
+					    efi_time_t *tm)
+{
+	if (!enabled || !pending || !tm)
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+	*enabled = emu.wakeup_enabled;
+	*pending = 0;
+	*tm = emu.wakeup_time;
+	mutex_unlock(&emu.lock);
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t efi_emu_set_wakeup_time(efi_bool_t enabled,
+					    efi_time_t *tm)
+{
+	if (enabled && (!tm || !efi_emu_valid_time(tm)))
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+	emu.wakeup_enabled = enabled;
+	if (tm)
+		emu.wakeup_time = *tm;
+	mutex_unlock(&emu.lock);
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t efi_emu_get_next_high_mono_count(u32 *count)
+{
+	if (!count)
+		return EFI_INVALID_PARAMETER;
+
+	mutex_lock(&emu.lock);
+	*count = ++emu.high_count;
+	mutex_unlock(&emu.lock);
+
+	return EFI_SUCCESS;
+}
+
+static void efi_emu_reset_system(int reset_type, efi_status_t status,
+				 unsigned long data_size, efi_char16_t *data)
+{
+	pr_info("efi_runtime: emulated ResetSystem(%d, 0x%lx) ignored\n",
+		reset_type, status);
+}
+
+static efi_status_t efi_emu_query_capsule_caps(efi_capsule_header_t **caps,
+					       unsigned long count,
+					       u64 *max_size, int *reset_type)
+{
+	return EFI_UNSUPPORTED;
+}
+
+static const struct efi_runtime_ops efi_emu_ops = {
+	.get_time			= efi_emu_get_time,
+	.set_time			= efi_emu_set_time,
+	.get_wakeup_time		= efi_emu_get_wakeup_time,
+	.set_wakeup_time		= efi_emu_set_wakeup_time,
+	.get_variable			= efi_emu_get_variable,
+	.get_next_variable		= efi_emu_get_next_variable,
+	.set_variable			= efi_emu_set_variable,
+	.get_next_high_mono_count	= efi_emu_get_next_high_mono_count,
+	.reset_system			= efi_emu_reset_system,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	.query_variable_info		= efi_emu_query_variable_info,
+	.query_capsule_caps		= efi_emu_query_capsule_caps,
+#endif
+};
+
+/*
+ * Enter the runtime services backend for 'call'.  This is the only place
+ * the driver calls the runtime services.
+ */
+static efi_status_t efi_runtime_firmware_call(struct efi_runtime_call *call)
+{
+	switch (call->cmd) {
+	case EFI_RUNTIME_GET_VARIABLE:
+		return efi_rt->get_variable(call->name,
+				CALL_ARG(call, GUID, &call->vendor_guid),
+				CALL_ARG(call, ATTR, &call->attributes),
+				CALL_ARG(call, SIZE, &call->size),
+				call->data);
+
+	case EFI_RUNTIME_SET_VARIABLE:
+		return efi_rt->set_variable(call->name, &call->vendor_guid,
+					    call->attributes, call->size,
+					    call->data);
+
+	case EFI_RUNTIME_GET_TIME:
+		return efi_rt->get_time(CALL_ARG(call, TIME, &call->time),
+					CALL_ARG(call, CAP, &call->cap));
+
+	case EFI_RUNTIME_SET_TIME:
+		return efi_rt->set_time(&call->time);
+
+	case EFI_RUNTIME_GET_WAKETIME:
+		return efi_rt->get_wakeup_time(
+				CALL_ARG(call, ENABLED, &call->enabled),
+				CALL_ARG(call, PENDING, &call->pending),
+				CALL_ARG(call, TIME, &call->time));
+
+	case EFI_RUNTIME_SET_WAKETIME:
+		return efi_rt->set_wakeup_time(call->enabled,
+				CALL_ARG(call, TIME, &call->time));
+
+	case EFI_RUNTIME_GET_NEXTVARIABLENAME:
+		return efi_rt->get_next_variable(
+				CALL_ARG(call, SIZE, &call->size),
+				call->name,
+				CALL_ARG(call, GUID, &call->vendor_guid));
+
+	case EFI_RUNTIME_GET_NEXTHIGHMONOTONICCOUNT:
+		return efi_rt->get_next_high_mono_count(
+				CALL_ARG(call, COUNT, &call->high_count));
+
+	case EFI_RUNTIME_RESET_SYSTEM:
+		efi_rt->reset_system(call->reset_type, call->reset_status,
+				     call->size, call->data);
+		return EFI_SUCCESS;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+	case EFI_RUNTIME_QUERY_VARIABLEINFO:
+		return efi_rt->query_variable_info(call->attributes,
+						   &call->max_storage,
+						   &call->remaining,
+						   &call->max_size);
+
+	case EFI_RUNTIME_QUERY_CAPSULECAPABILITIES:
+		return efi_rt->query_capsule_caps(
+				(efi_capsule_header_t **)&call->data,
+				call->size, &call->max_size,
+				&call->reset_type);
+#endif
+	}
+
+	return EFI_UNSUPPORTED;
+}
+
+/*
+ * QueryVariableInfo cache.
+ *
+ * Storage checks tend to query several attribute masks before every
+ * write.  Successful results are kept per attribute mask until a
+ * SetVariable succeeds or qvi_cache_ttl_ms passes.  Every invalidation
+ * starts a new generation, and a result is only cached if no
+ * invalidation happened while its call was in flight.
+ */
+static unsigned int qvi_cache_ttl_ms;
+module_param(qvi_cache_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(qvi_cache_ttl_ms,
+		 "QueryVariableInfo cache lifetime in ms, 0 to disable");
+
+#define EFI_QVI_ATTRIBUTES	0x7f
+
+struct efi_qvi_entry {
+	u64			gen;
+	unsigned long		expires;
+	u64			max_storage;
+	u64			remaining;
+	u64			max_size;
+};
+
+static DEFINE_SPINLOCK(qvi_lock);
+static struct efi_qvi_entry qvi_cache[EFI_QVI_ATTRIBUTES + 1];
+static u64 qvi_gen = 1;
+
+static struct {
+	atomic64_t		hits;
+	atomic64_t		misses;
+	atomic64_t		invalidations;
+} qvi_stats;
+
+static bool efi_qvi_lookup(struct efi_runtime_call *call)
+{
+	struct efi_qvi_entry *entry;
+	bool hit = false;
+
+	if (!READ_ONCE(qvi_cache_ttl_ms) ||
+	    call->attributes & ~EFI_QVI_ATTRIBUTES)
+		return false;
+
+	entry = &qvi_cache[call->attributes];
+
+	spin_lock(&qvi_lock);
+	if (entry->gen == qvi_gen && time_before(jiffies, entry->expires)) {
+		call->max_storage = entry->max_storage;
+		call->remaining = entry->remaining;
+		call->max_size = entry->max_size;
+		call->status = EFI_SUCCESS;
+		call->answered = true;
+		hit = true;
+	}
+	spin_unlock(&qvi_lock);
+
+	atomic64_inc(hit ? &qvi_stats.hits : &qvi_stats.misses);
+
+	return hit;
+}
+
+static u64 efi_qvi_generation(void)
+{
+	u64 gen;
+
+	spin_lock(&qvi_lock);
+	gen = qvi_gen;
+	spin_unlock(&qvi_lock);
+
+	return gen;
+}
+
+/* Cache the result of 'call', issued during generation 'gen' */
+static void efi_qvi_store(struct efi_runtime_call *call, u64 gen)
+{
+	struct efi_qvi_entry *entry;
+	unsigned int ttl_ms = READ_ONCE(qvi_cache_ttl_ms);
+
+	if (!ttl_ms || call->attributes & ~EFI_QVI_ATTRIBUTES)
+		return;
+
+	entry = &qvi_cache[call->attributes];
+
+	spin_lock(&qvi_lock);
+	if (gen == qvi_gen) {
+		entry->gen = gen;
+		entry->expires = jiffies + msecs_to_jiffies(ttl_ms);
+		entry->max_storage = call->max_storage;
+		entry->remaining = call->remaining;
+		entry->max_size = call->max_size;
+	}
+	spin_unlock(&qvi_lock);
+}
+
+static void efi_qvi_invalidate(void)
+{
+	spin_lock(&qvi_lock);
+	qvi_gen++;
+	spin_unlock(&qvi_lock);
+
+	atomic64_inc(&qvi_stats.invalidations);
+}
+
+/*
+ * Variable store footprint.
+ *
+ * An index of the data size of every variable, with the number of
+ * variables, their bytes and the largest one per vendor GUID, shown in
+ * /proc/efi_runtime/footprint.  It is built by enumerating the store the
+ * first time the file is read and is then kept current by SetVariable
+ * calls as firmware completes them.  Appends and authenticated writes
+ * don't tell the resulting size, so they mark the variable stale and its
+ * size is queried again on the next read.  Deferred writes count once
+ * they reach firmware.
+ *
+ * footprint_mutex protects the index and is taken by the worker;
+ * footprint_scan_mutex serializes builds and refreshes, which call
+ * firmware and so must not hold footprint_mutex meanwhile.
+ */
+#define EFI_FOOTPRINT_HASH_BITS	8
+
+/* footprint_state */
+enum {
+	FOOTPRINT_EMPTY,	/* not built, writes are ignored */
+	FOOTPRINT_BUILDING,	/* being enumerated */
+	FOOTPRINT_READY,
+};
+
+struct efi_footprint_guid {
+	struct list_head	node;
+	efi_guid_t		vendor_guid;
+	struct list_head	vars;
+	u32			count;
+	u64			bytes;
+	unsigned long		largest;
+};
+
+struct efi_footprint_var {
+	struct hlist_node	node;
+	struct list_head	guid_node;
+	struct list_head	stale_node;
+	struct efi_footprint_guid *guid;
+	unsigned long		size;
+	u32			seq;		/* bumped by every write */
+	size_t			name_size;
+	efi_char16_t		name[];
+};
+
+static DEFINE_MUTEX(footprint_mutex);
+static DEFINE_MUTEX(footprint_scan_mutex);
+static DEFINE_HASHTABLE(footprint_vars, EFI_FOOTPRINT_HASH_BITS);
+static LIST_HEAD(footprint_guids);
+static LIST_HEAD(footprint_stale);
+static int footprint_state = FOOTPRINT_EMPTY;
+
+static u32 efi_var_hash(const efi_guid_t *vendor,
+			      const efi_char16_t *name, size_t name_size)
+{
+	return jhash(name, name_size, jhash(vendor, sizeof(*vendor), 0));
+}
+
+static struct efi_footprint_var *
+efi_footprint_find(const efi_guid_t *vendor, const efi_char16_t *name,
+		   size_t name_size, u32 key)
+{
+	struct efi_footprint_var *var;
+
+	hash_for_each_possible(footprint_vars, var, node, key) {
+		if (var->name_size == name_size &&
+		    !efi_guidcmp(var->guid->vendor_guid, *vendor) &&
+		    !memcmp(var->name, name, name_size))
+			return var;
+	}
+	return NULL;
+}
+
+static void efi_footprint_resize(struct efi_footprint_var *var,
+				 unsigned long size)
+{
+	struct efi_footprint_guid *guid = var->guid;
+	struct efi_footprint_var *pos;
+	unsigned long old = var->size;
+
+	var->size = size;
+	guid->bytes = guid->bytes - old + size;
+
+	if (size >= guid->largest) {
+		guid->largest = size;
+	} else if (old == guid->largest) {
+		guid->largest = 0;
+		list_for_each_entry(pos, &guid->vars, guid_node)
+			guid->largest = max(guid->largest, pos->size);
+	}
+}
+
+/* Add an empty entry for a variable not in the index */
+static struct efi_footprint_var *
+efi_footprint_new(const efi_guid_t *vendor, const efi_char16_t *name,
+		  size_t name_size, u32 key)
+{
+	struct efi_footprint_guid *guid;
+	struct efi_footprint_var *var;
+
+	list_for_each_entry(guid, &footprint_guids, node) {
+		if (!efi_guidcmp(guid->vendor_guid, *vendor))
+			goto found;
+	}
+
+	guid = kzalloc(sizeof(*guid), GFP_KERNEL);
+	if (!guid)
+		return NULL;
+	guid->vendor_guid = *vendor;
+	INIT_LIST_HEAD(&guid->vars);
+	list_add_tail(&guid->node, &footprint_guids);
+
+found:
+	var = kzalloc(sizeof(*var) + name_size, GFP_KERNEL);
+	if (!var)
+		return NULL;
+	memcpy(var->name, name, name_size);
+	var->name_size = name_size;
+	var->guid = guid;
+	INIT_LIST_HEAD(&var->stale_node);
+	list_add_tail(&var->guid_node, &guid->vars);
+	hash_add(footprint_vars, &var->node, key);
+	guid->count++;
+
+	return var;
+}
+
+static void efi_footprint_remove(struct efi_footprint_var *var)
+{
+	efi_footprint_resize(var, 0);
+	var->guid->count--;
+	hash_del(&var->node);
+	list_del(&var->guid_node);
+	list_del(&var->stale_node);
+	kfree(var);
+}
+
+/* Drop the whole index, it is built again on the next read */
+static void efi_footprint_free(void)
+{
+	struct efi_footprint_guid *guid, *tmp_guid;
+	struct efi_footprint_var *var, *tmp_var;
+
+	list_for_each_entry_safe(guid, tmp_guid, &footprint_guids, node) {
+		list_for_each_entry_safe(var, tmp_var, &guid->vars, guid_node) {
+			hash_del(&var->node);
+			list_del(&var->stale_node);
+			kfree(var);
+		}
+		list_del(&guid->node);
+		kfree(guid);
+	}
+
+	footprint_state = FOOTPRINT_EMPTY;
+}
+
+/* Account the successful SetVariable 'call' */
+static void efi_footprint_update(struct efi_runtime_call *call)
+{
+	struct efi_footprint_var *var;
+	size_t name_size;
+	bool stale, delete;
+	u32 key;
+
+	if (READ_ONCE(footprint_state) == FOOTPRINT_EMPTY || !call->name)
+		return;
+
+	stale = call->attributes &
+		(EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+		 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS |
+		 EFI_VARIABLE_APPEND_WRITE);
+	delete = !call->attributes || (!stale && !call->size);
+
+	name_size = efi_ucs2_size(call->name, SIZE_MAX);
+	key = efi_var_hash(&call->vendor_guid, call->name, name_size);
+
+	mutex_lock(&footprint_mutex);
+	if (footprint_state == FOOTPRINT_EMPTY)
+		goto out;
+
+	var = efi_footprint_find(&call->vendor_guid, call->name, name_size,
+				 key);
+	if (!var) {
+		/* A variable the build has yet to see needs a tombstone */
+		if (delete && footprint_state == FOOTPRINT_READY)
+			goto out;
+		var = efi_footprint_new(&call->vendor_guid, call->name,
+					name_size, key);
+		if (!var) {
+			efi_footprint_free();
+			goto out;
+		}
+	}
+
+	var->seq++;
+	if (delete && footprint_state == FOOTPRINT_READY) {
+		efi_footprint_remove(var);
+	} else if (delete || stale) {
+		if (list_empty(&var->stale_node))
+			list_add_tail(&var->stale_node, &footprint_stale);
+	} else {
+		list_del_init(&var->stale_node);
+		efi_footprint_resize(var, call->size);
+	}
+
+out:
+	mutex_unlock(&footprint_mutex);
+}
+
+/*
+ * Variable read cache.
+ *
+ * Holds variables read ahead by the warm-up so GetVariable can be
+ * answered without entering firmware.  An entry is dropped when its
+ * variable is written through the driver and expires after
+ * read_cache_ttl_ms, which also bounds how long a write made around the
+ * driver, through efivarfs say, goes unseen.  Every SetVariable starts a
+ * new generation, and a variable read while one happened is not cached.
+ * EFI_RUNTIME_GET_VARIABLE_FRESH skips the cache.
+ */
+static unsigned int read_cache_ttl_ms = 1000;
+module_param(read_cache_ttl_ms, uint, 0644);
+MODULE_PARM_DESC(read_cache_ttl_ms,
+		 "Variable read cache lifetime in ms, 0 to disable");
+
+static unsigned int read_cache_max_kb = 1024;
+module_param(read_cache_max_kb, uint, 0644);
+MODULE_PARM_DESC(read_cache_max_kb, "Variable read cache size in KiB");
+
+#define EFI_READ_CACHE_HASH_BITS	8
+
+struct efi_read_entry {
+	struct hlist_node	node;
+	efi_guid_t		vendor_guid;
+	u32			attributes;
+	unsigned long		expires;
+	unsigned long		size;
+	void			*data;
+	size_t			name_size;
+	efi_char16_t		name[];
+};
+
+static DEFINE_MUTEX(read_cache_mutex);
+static DEFINE_HASHTABLE(read_cache, EFI_READ_CACHE_HASH_BITS);
+static unsigned int read_cache_entries;
+static size_t read_cache_bytes;
+static u64 read_cache_gen = 1;
+
+static struct {
+	atomic64_t		hits;
+	atomic64_t		misses;
+	atomic64_t		invalidations;
+} read_cache_stats;
+
+static struct efi_read_entry *
+efi_read_cache_find(const efi_guid_t *vendor, const efi_char16_t *name,
+		    size_t name_size, u32 key)
+{
+	struct efi_read_entry *entry;
+
+	hash_for_each_possible(read_cache, entry, node, key) {
+		if (entry->name_size == name_size &&
+		    !efi_guidcmp(entry->vendor_guid, *vendor) &&
+		    !memcmp(entry->name, name, name_size))
+			return entry;
+	}
+	return NULL;
+}
+
+static void efi_read_cache_remove(struct efi_read_entry *entry)
+{
+	hash_del(&entry->node);
+	read_cache_entries--;
+	read_cache_bytes -= entry->size;
+	kvfree(entry->data);
+	kfree(entry);
+}
+
+/* Answer the GetVariable 'call' from the cache if possible */
+static bool efi_read_cache_lookup(struct efi_runtime_call *call)
+{
+	struct efi_read_entry *entry;
+	size_t name_size;
+	bool hit = false;
+
+	if (!READ_ONCE(read_cache_entries) || !READ_ONCE(read_cache_ttl_ms) ||
+	    !call->name || !(call->args & EFI_RUNTIME_ARG_GUID))
+		return false;
+
+	name_size = efi_ucs2_size(call->name, SIZE_MAX);
+
+	mutex_lock(&read_cache_mutex);
+
+	entry = efi_read_cache_find(&call->vendor_guid, call->name, name_size,
+			efi_var_hash(&call->vendor_guid, call->name,
+				     name_size));
+	if (entry && !time_before(jiffies, entry->expires)) {
+		efi_read_cache_remove(entry);
+		entry = NULL;
+	}
+
+	if (entry) {
+		if (!(call->args & EFI_RUNTIME_ARG_SIZE)) {
+			call->status = EFI_INVALID_PARAMETER;
+		} else if (call->size < entry->size) {
+			call->size = entry->size;
+			call->status = EFI_BUFFER_TOO_SMALL;
+		} else if (!call->data) {
+			call->status = EFI_INVALID_PARAMETER;
+		} else {
+			memcpy(call->data, entry->data, entry->size);
+			call->size = entry->size;
+			call->attributes = entry->attributes;
+			call->status = EFI_SUCCESS;
+		}
+		call->answered = true;
+		hit = true;
+	}
+
+	mutex_unlock(&read_cache_mutex);
+
+	atomic64_inc(hit ? &read_cache_stats.hits : &read_cache_stats.misses);
+
+	return hit;
+}
+
+static u64 efi_read_cache_generation(void)
+{
+	u64 gen;
+
+	mutex_lock(&read_cache_mutex);
+	gen = read_cache_gen;
+	mutex_unlock(&read_cache_mutex);
+
+	return gen;
+}
+
+/*
+ * Cache a copy of a variable read during generation 'gen'.  Returns
+ * -ENOSPC when the cache is full and -EAGAIN when a write may have
+ * changed the variable since.
+ */
+static int efi_read_cache_insert(const efi_guid_t *vendor,
+				 const efi_char16_t *name, size_t name_size,
+				 u32 attributes, const void *data,
+				 unsigned long size, u64 gen)
+{
+	size_t max = efi_kb_to_bytes(READ_ONCE(read_cache_max_kb));
+	unsigned int ttl_ms = READ_ONCE(read_cache_ttl_ms);
+	struct efi_read_entry *entry, *old;
+	u32 key;
+	int rv = 0;
+
+	if (!ttl_ms)
+		return -ENOSPC;
+
+	entry = kzalloc(sizeof(*entry) + name_size, GFP_KERNEL);
+	if (!entry)
+		return -ENOMEM;
+	entry->data = efi_runtime_kvmalloc(max_t(size_t, size, 1));
+	if (!entry->data) {
+		kfree(entry);
+		return -ENOMEM;
+	}
+	memcpy(entry->data, data, size);
+	memcpy(entry->name, name, name_size);
+	entry->name_size = name_size;
+	entry->vendor_guid = *vendor;
+	entry->attributes = attributes;
+	entry->size = size;
+	entry->expires = jiffies + msecs_to_jiffies(ttl_ms);
+
+	key = efi_var_hash(vendor, name, name_size);
+
+	mutex_lock(&read_cache_mutex);
+	old = efi_read_cache_find(vendor, name, name_size, key);
+	if (gen != read_cache_gen) {
+		rv = -EAGAIN;
+	} else if (read_cache_bytes - (old ? old->size : 0) + size > max) {
+		rv = -ENOSPC;
+	} else {
+		if (old)
+			efi_read_cache_remove(old);
+		hash_add(read_cache, &entry->node, key);
+		read_cache_entries++;
+		read_cache_bytes += size;
+		entry = NULL;
+	}
+	mutex_unlock(&read_cache_mutex);
+
+	if (entry) {
+		kvfree(entry->data);
+		kfree(entry);
+	}
+	return rv;
+}
+
+/* Forget the variable the successful SetVariable 'call' wrote */
+static void efi_read_cache_invalidate(struct efi_runtime_call *call)
+{
+	struct efi_read_entry *entry = NULL;
+	size_t name_size;
+
+	mutex_lock(&read_cache_mutex);
+	read_cache_gen++;
+	if (call->name && read_cache_entries) {
+		name_size = efi_ucs2_size(call->name, SIZE_MAX);
+		entry = efi_read_cache_find(&call->vendor_guid, call->name,
+				name_size, efi_var_hash(&call->vendor_guid,
+							call->name, name_size));
+		if (entry)
+			efi_read_cache_remove(entry);
+	}
+	mutex_unlock(&read_cache_mutex);
+
+	if (entry)
+		atomic64_inc(&read_cache_stats.invalidations);
+}
+
+static void efi_read_cache_free(void)
+{
+	struct efi_read_entry *entry;
+	struct hlist_node *tmp;
+	int bkt;
+
+	mutex_lock(&read_cache_mutex);
+	hash_for_each_safe(read_cache, bkt, tmp, entry, node)
+		efi_read_cache_remove(entry);
+	mutex_unlock(&read_cache_mutex);
+}
+
+/*
+ * Firmware worker.
+ *
+ * Runtime services are entered from an ordered workqueue owned by the
+ * driver rather than in the caller's context.  Callers wait for their
+ * call with an optional per-file deadline and can abandon the wait on a
+ * signal; an abandoned call still runs to completion on the worker,
+ * holding firmware until it returns.
+ */
+static unsigned int call_timeout_ms;
+module_param(call_timeout_ms, uint, 0644);
+MODULE_PARM_DESC(call_timeout_ms,
+		 "Default per-call deadline in ms for new files, 0 to wait forever");
+
+static struct workqueue_struct *efi_runtime_wq;
+
+static struct {
+	atomic64_t		calls;
+	atomic64_t		queue_timeouts;
+	atomic64_t		firmware_timeouts;
+	atomic64_t		interrupted;
+	atomic64_t		late_completions;
+	atomic64_t		max_firmware_ns;
+} worker_stats;
+
+static void efi_runtime_worker_update_max(u64 ns)
+{
+	s64 old = atomic64_read(&worker_stats.max_firmware_ns);
+
+	while (ns > old) {
+		s64 prev = atomic64_cmpxchg(&worker_stats.max_firmware_ns,
+					    old, ns);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+static void efi_runtime_work(struct work_struct *work)
+{
+	struct efi_runtime_call *call;
+	u64 start;
+
+	call = container_of(work, struct efi_runtime_call, work);
+
+	start = ktime_get_ns();
+	call->status = efi_runtime_firmware_call(call);
+	if (efi_rt == &efi_emu_ops)
+		efi_emu_call_latency(call);
+	call->firmware_ns = ktime_get_ns() - start;
+
+	/* Also for calls whose caller gave up waiting */
+	if (call->cmd == EFI_RUNTIME_SET_VARIABLE &&
+	    call->status == EFI_SUCCESS) {
+		efi_qvi_invalidate();
+		efi_footprint_update(call);
+		efi_read_cache_invalidate(call);
+	}
+
+	efi_sched_release();
+
+	efi_runtime_worker_update_max(call->firmware_ns);
+	if (atomic_xchg(&call->state, CALL_DONE) == CALL_ABANDONED)
+		atomic64_inc(&worker_stats.late_completions);
+
+	complete(&call->done);
+	efi_runtime_call_put(call);
+}
+
+/*
+ * Run 'call' in firmware once the scheduler grants it.  The EFI status is
+ * left in call->status; a non-zero return means the results must not be
+ * used, either because firmware was never entered or because the caller
+ * stopped waiting for it.  The wait ends after 'timeout_ms', or never if
+ * it is 0.
+ */
+static int efi_runtime_dispatch_timeout(struct efi_runtime_call *call,
+					unsigned int timeout_ms)
+{
+	int rv;
+
+	if (timeout_ms)
+		call->deadline = jiffies + msecs_to_jiffies(timeout_ms) ?: 1;
+
+	rv = efi_sched_acquire(call);
+	if (rv) {
+		atomic64_inc(rv == -ETIMEDOUT ? &worker_stats.queue_timeouts :
+						&worker_stats.interrupted);
+		return rv;
+	}
+
+	efi_runtime_trace_args(call);
+
+	atomic64_inc(&worker_stats.calls);
+	init_completion(&call->done);
+	INIT_WORK(&call->work, efi_runtime_work);
+	atomic_set(&call->state, CALL_QUEUED);
+	kref_get(&call->ref);
+	queue_work(efi_runtime_wq, &call->work);
+
+	rv = efi_runtime_wait(call, &call->done);
+	if (!rv)
+		return 0;
+
+	/* Firmware may have returned just as the wait ended */
+	if (atomic_xchg(&call->state, CALL_ABANDONED) == CALL_DONE) {
+		atomic_set(&call->state, CALL_DONE);
+		return 0;
+	}
+
+	atomic64_inc(rv == -ETIMEDOUT ? &worker_stats.firmware_timeouts :
+					&worker_stats.interrupted);
+	return rv;
+}
+
+/* Dispatch 'call' under its file's deadline */
+static int efi_runtime_dispatch(struct efi_runtime_call *call)
+{
+	return efi_runtime_dispatch_timeout(call,
+				READ_ONCE(call->owner->timeout_ms));
+}
+
+static long efi_runtime_set_timeout(struct efi_runtime_file *file,
+				    unsigned long arg)
+{
+	__u32 timeout_ms;
+
+	if (get_user(timeout_ms, (__u32 __user *)arg))
+		return -EFAULT;
+
+	WRITE_ONCE(file->timeout_ms, timeout_ms);
+
+	return 0;
+}
+
+/*
+ * Deferred writes.
+ *
+ * A file in deferred mode (EFI_RUNTIME_SET_DEFERRED) has its plain
+ * non-volatile SetVariable calls buffered by (GUID, name) instead of
+ * written to flash, a later write to the same variable replacing the
+ * buffered value.  Buffered writes reach firmware from the file's work
+ * when its window expires, on EFI_RUNTIME_FLUSH and on close.
+ * GetVariable through any file returns a buffered value in preference to
+ * the one in firmware, also while it is being written.
+ *
+ * Deletes, appends, authenticated and volatile writes are never
+ * buffered.  Neither are writes from files not in deferred mode, nor
+ * writes of new variables from a file whose buffer is full.  Any such
+ * write to a variable with a buffered value waits until that value has
+ * reached firmware.  Writes of the same variable reach firmware in the
+ * order they were made.
+ *
+ * Only GetVariable sees buffered values: GetNextVariableName and
+ * QueryVariableInfo answer from firmware, so a variable created by a
+ * buffered write is not enumerated, nor its size counted, until the
+ * write has been flushed.
+ *
+ * An entry holds a reference on the file owning it, and so does the
+ * file's work while queued, so buffered writes outlive the file.
+ */
+static unsigned int defer_max_pending = 64;
+module_param(defer_max_pending, uint, 0644);
+MODULE_PARM_DESC(defer_max_pending,
+		 "Buffered writes per file before the buffer is written out");
+
+#define EFI_DEFER_WINDOW_MAX	(60 * 60 * 1000)
+
+struct efi_defer_entry {
+	struct list_head	node;
+	struct list_head	batch;
+	/* holds a reference, see efi_defer_free() */
+	struct efi_runtime_file	*owner;
+	bool			issuing;
+	efi_guid_t		vendor_guid;
+	efi_char16_t		*name;
+	size_t			name_size;
+	u32			attributes;
+	void			*data;
+	unsigned long		size;
+	/* the data, charged to 'owner' */
+	size_t			charged;
+};
+
+/*
+ * Buffered writes of all files, oldest first, including those being
+ * written.  defer_gen counts the writes completed, and waiters for one
+ * sleep on defer_wq.  The writes are made from efi_runtime_defer_wq,
+ * as each may keep its worker in firmware for a long time.
+ */
+static DEFINE_MUTEX(defer_mutex);
+static LIST_HEAD(defer_entries);
+static atomic_t defer_count = ATOMIC_INIT(0);
+static unsigned long defer_gen;
+static DECLARE_WAIT_QUEUE_HEAD(defer_wq);
+static struct workqueue_struct *efi_runtime_defer_wq;
+
+static struct {
+	atomic64_t		writes;
+	atomic64_t		coalesced;
+	atomic64_t		flushed;
+	atomic64_t		flush_errors;
+} defer_stats;
+
+static bool efi_defer_eligible(struct efi_runtime_call *call)
+{
+	u32 attr = call->attributes;
+
+	return call->name && call->size &&
+	       (attr & EFI_VARIABLE_NON_VOLATILE) &&
+	       !(attr & (EFI_VARIABLE_HARDWARE_ERROR_RECORD |
+			 EFI_VARIABLE_AUTHENTICATED_WRITE_ACCESS |
+			 EFI_VARIABLE_TIME_BASED_AUTHENTICATED_WRITE_ACCESS |
+			 EFI_VARIABLE_APPEND_WRITE));
+}
+
+static bool efi_defer_match(struct efi_defer_entry *entry,
+			    const efi_guid_t *vendor,
+			    const efi_char16_t *name, size_t name_size)
+{
+	return entry->name_size == name_size &&
+	       !efi_guidcmp(entry->vendor_guid, *vendor) &&
+	       !memcmp(entry->name, name, name_size);
+}
+
+/* The latest buffered write of the variable of 'call' */
+static struct efi_defer_entry *efi_defer_find(struct efi_runtime_call *call)
+{
+	struct efi_defer_entry *entry;
+	size_t name_size = efi_ucs2_size(call->name, SIZE_MAX);
+
+	list_for_each_entry_reverse(entry, &defer_entries, node) {
+		if (efi_defer_match(entry, &call->vendor_guid, call->name,
+				    name_size))
+			return entry;
+	}
+	return NULL;
+}
+
+/* Whether an earlier write of the variable of 'entry' is still buffered */
+static bool efi_defer_older(struct efi_defer_entry *entry)
+{
+	struct efi_defer_entry *old;
+
+	list_for_each_entry(old, &defer_entries, node) {
+		if (old == entry)
+			break;
+		if (efi_defer_match(old, &entry->vendor_guid, entry->name,
+				    entry->name_size))
+			return true;
+	}
+	return false;
+}
+
+static void efi_defer_free(struct efi_defer_entry *entry)
+{
+	if (entry->charged)
+		efi_runtime_file_uncharge(entry->owner, entry->charged);
+	efi_runtime_file_put(entry->owner);
+	kfree(entry->name);
+	kvfree(entry->data);
+	kfree(entry);
+}
+
+/*
+ * Write 'entry', which the owner's work has marked as issuing, to
+ * firmware and free it.  There is no deadline and a worker takes no
+ * signals, so the wait only ends once firmware has answered.
+ */
+static void efi_defer_issue(struct efi_defer_entry *entry)
+{
+	struct efi_runtime_file *file = entry->owner;
+	struct efi_runtime_call *call;
+	unsigned long gen;
+	int rv;
+
+	mutex_lock(&defer_mutex);
+	while (efi_defer_older(entry)) {
+		gen = defer_gen;
+		mutex_unlock(&defer_mutex);
+		wait_event(defer_wq, READ_ONCE(defer_gen) != gen);
+		mutex_lock(&defer_mutex);
+	}
+	mutex_unlock(&defer_mutex);
+
+	call = efi_runtime_call_alloc(file, EFI_RUNTIME_SET_VARIABLE);
+	if (call) {
+		/*
+		 * The call shares the buffers until the entry is off the
+		 * list, so GetVariable can still be answered from them.
+		 */
+		call->name = entry->name;
+		call->data = entry->data;
+		call->vendor_guid = entry->vendor_guid;
+		call->args |= EFI_RUNTIME_ARG_GUID;
+		call->attributes = entry->attributes;
+		call->size = entry->size;
+
+		if (READ_ONCE(trace_enabled))
+			call->trace_start = ktime_get_ns();
+
+		rv = efi_runtime_dispatch_timeout(call, 0);
+		if (!rv && call->status != EFI_SUCCESS)
+			rv = -EIO;
+	} else {
+		rv = -ENOMEM;
+	}
+
+	mutex_lock(&defer_mutex);
+	list_del(&entry->node);
+	atomic_dec(&defer_count);
+	defer_gen++;
+	file->defer_owned--;
+	file->defer_stats.flushed++;
+	if (rv)
+		file->defer_stats.flush_errors++;
+	mutex_unlock(&defer_mutex);
+	wake_up_all(&defer_wq);
+
+	if (call) {
+		entry->name = NULL;
+		entry->data = NULL;
+		if (call->trace_start)
+			efi_runtime_trace_commit(call, rv);
+		efi_runtime_call_put(call);
+	}
+	efi_defer_free(entry);
+
+	atomic64_inc(&defer_stats.flushed);
+	if (rv) {
+		atomic64_inc(&defer_stats.flush_errors);
+		pr_warn_ratelimited("efi_runtime: deferred SetVariable failed: %d\n",
+				    rv);
+	}
+}
+
+/*
+ * Write all of 'file's buffered writes.  They are taken under
+ * defer_mutex and written without it, so other callers are not held up
+ * while firmware runs.
+ */
+static void efi_defer_work(struct work_struct *work)
+{
+	struct efi_runtime_file *file;
+	struct efi_defer_entry *entry, *tmp;
+	LIST_HEAD(batch);
+
+	file = container_of(to_delayed_work(work), struct efi_runtime_file,
+			    defer_work);
+
+	mutex_lock(&defer_mutex);
+	list_for_each_entry(entry, &defer_entries, node) {
+		if (entry->owner != file || entry->issuing)
+			continue;
+		entry->issuing = true;
+		file->defer_stats.pending--;
+		list_add_tail(&entry->batch, &batch);
+	}
+	mutex_unlock(&defer_mutex);
+
+	list_for_each_entry_safe(entry, tmp, &batch, batch)
+		efi_defer_issue(entry);
+
+	/* Taken by efi_defer_kick() */
+	efi_runtime_file_put(file);
+}
+
+/*
+ * Queue 'file's work to run in 'delay' jiffies, or at once, moving it
+ * forward, for 0.  The caller holds a reference on 'file'; the queued
+ * work takes its own.
+ */
+static void efi_defer_kick(struct efi_runtime_file *file,
+			   unsigned long delay)
+{
+	bool queued;
+
+	kref_get(&file->ref);
+	if (delay)
+		queued = queue_delayed_work(efi_runtime_defer_wq,
+					    &file->defer_work, delay);
+	else
+		queued = !mod_delayed_work(efi_runtime_defer_wq,
+					   &file->defer_work, 0);
+	if (!queued)
+		efi_runtime_file_put(file);
+}
+
+/*
+ * Write 'file's buffered writes now and wait until none are left.  The
+ * caller gives up on a signal or at the file's deadline; the buffered
+ * writes still reach firmware.
+ */
+static int efi_defer_sync(struct efi_runtime_file *file)
+{
+	unsigned int timeout_ms = READ_ONCE(file->timeout_ms);
+	long left = timeout_ms ? msecs_to_jiffies(timeout_ms) :
+				 MAX_SCHEDULE_TIMEOUT;
+
+	efi_defer_kick(file, 0);
+
+	left = wait_event_interruptible_timeout(defer_wq,
+			!READ_ONCE(file->defer_owned), left);
+	if (left < 0) {
+		atomic64_inc(&worker_stats.interrupted);
+		return -EINTR;
+	}
+	if (!left) {
+		atomic64_inc(&worker_stats.queue_timeouts);
+		return -ETIMEDOUT;
+	}
+
+	return 0;
+}
+
+/*
+ * Wait until no write of the variable of 'call' is buffered, having the
+ * files holding them write them now.  Called and returns with
+ * defer_mutex held.  The caller gives up on a signal or at its file's
+ * deadline; the buffered writes still reach firmware.
+ */
+static int efi_defer_wait(struct efi_runtime_call *call)
+{
+	unsigned int timeout_ms = READ_ONCE(call->owner->timeout_ms);
+	long left = timeout_ms ? msecs_to_jiffies(timeout_ms) :
+				 MAX_SCHEDULE_TIMEOUT;
+	size_t name_size = efi_ucs2_size(call->name, SIZE_MAX);
+	struct efi_defer_entry *entry;
+	unsigned long gen;
+	bool found;
+
+	for (;;) {
+		found = false;
+		list_for_each_entry(entry, &defer_entries, node) {
+			if (!efi_defer_match(entry, &call->vendor_guid,
+					     call->name, name_size))
+				continue;
+			found = true;
+			if (!entry->issuing)
+				efi_defer_kick(entry->owner, 0);
+		}
+		if (!found)
+			return 0;
+
+		gen = defer_gen;
+		mutex_unlock(&defer_mutex);
+		left = wait_event_interruptible_timeout(defer_wq,
+				READ_ONCE(defer_gen) != gen, left);
+		mutex_lock(&defer_mutex);
+
+		if (left < 0) {
+			atomic64_inc(&worker_stats.interrupted);
+			return -EINTR;
+		}
+		if (!left) {
+			atomic64_inc(&worker_stats.queue_timeouts);
+			return -ETIMEDOUT;
+		}
+	}
+}
+
+/*
+ * Buffer the SetVariable 'call' if its file is in deferred mode.
+ * Returns 1 if the call was buffered, 0 if it must go to firmware and
+ * an error if it gave up waiting for a buffered write of the same
+ * variable, which has to reach firmware first.
+ */
+static int efi_defer_write(struct efi_runtime_call *call)
+{
+	struct efi_runtime_file *file = call->owner;
+	struct efi_defer_entry *entry;
+	void *data;
+	int rv = 1;
+
+	if (!call->name)
+		return 0;
+
+	if (!READ_ONCE(file->defer_stats.window_ms) &&
+	    !atomic_read(&defer_count))
+		return 0;
+
+	mutex_lock(&defer_mutex);
+
+	entry = efi_defer_find(call);
+
+	if (!file->defer_stats.window_ms || !efi_defer_eligible(call)) {
+		if (file->defer_stats.window_ms)
+			file->defer_stats.passthrough++;
+		rv = entry ? efi_defer_wait(call) : 0;
+		goto out;
+	}
+
+	/* A value being written can't be replaced; buffer one behind it */
+	if (entry && entry->issuing)
+		entry = NULL;
+
+	/* The copy is charged to the file like the call's own buffers */
+	if ((!entry &&
+	     file->defer_stats.pending >= READ_ONCE(defer_max_pending)) ||
+	    efi_runtime_file_charge(file, call->size)) {
+		/* The buffer is full: write it out, and this one through */
+		efi_defer_kick(file, 0);
+		file->defer_stats.passthrough++;
+		rv = efi_defer_wait(call);
+		goto out;
+	}
+
+	data = efi_runtime_kvmalloc(call->size);
+	if (!data) {
+		efi_runtime_file_uncharge(file, call->size);
+		rv = -ENOMEM;
+		goto out;
+	}
+	memcpy(data, call->data, call->size);
+
+	if (entry) {
+		efi_runtime_file_uncharge(entry->owner, entry->charged);
+		kvfree(entry->data);
+		entry->data = data;
+		entry->size = call->size;
+		entry->charged = call->size;
+		entry->attributes = call->attributes;
+		list_move_tail(&entry->node, &defer_entries);
+		if (entry->owner != file) {
+			entry->owner->defer_stats.pending--;
+			entry->owner->defer_owned--;
+			/* The old owner may be syncing, see efi_defer_sync() */
+			wake_up_all(&defer_wq);
+			efi_runtime_file_put(entry->owner);
+			kref_get(&file->ref);
+			entry->owner = file;
+			file->defer_stats.pending++;
+			file->defer_owned++;
+		}
+		file->defer_stats.coalesced++;
+		atomic64_inc(&defer_stats.coalesced);
+	} else {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if (entry) {
+			entry->name_size = efi_ucs2_size(call->name, SIZE_MAX);
+			entry->name = kmemdup(call->name, entry->name_size,
+					      GFP_KERNEL);
+		}
+		if (!entry || !entry->name) {
+			kfree(entry);
+			kvfree(data);
+			efi_runtime_file_uncharge(file, call->size);
+			rv = -ENOMEM;
+			goto out;
+		}
+		kref_get(&file->ref);
+		entry->owner = file;
+		entry->vendor_guid = call->vendor_guid;
+		entry->attributes = call->attributes;
+		entry->data = data;
+		entry->size = call->size;
+		entry->charged = call->size;
+		list_add_tail(&entry->node, &defer_entries);
+		file->defer_stats.pending++;
+		file->defer_owned++;
+		atomic_inc(&defer_count);
+	}
+
+	call->status = EFI_SUCCESS;
+	call->answered = true;
+	file->defer_stats.writes++;
+	atomic64_inc(&defer_stats.writes);
+	efi_defer_kick(file, msecs_to_jiffies(file->defer_stats.window_ms));
+out:
+	mutex_unlock(&defer_mutex);
+
+	return rv;
+}
+
+/*
+ * Answer the GetVariable 'call' from a buffered write, as firmware would
+ * once the write reached it.  Returns true if the call was answered.
+ */
+static bool efi_defer_read(struct efi_runtime_call *call)
+{
+	struct efi_defer_entry *entry;
+
+	if (!atomic_read(&defer_count) || !call->name ||
+	    !(call->args & EFI_RUNTIME_ARG_GUID))
+		return false;
+
+	mutex_lock(&defer_mutex);
+
+	entry = efi_defer_find(call);
+	if (!entry) {
+		mutex_unlock(&defer_mutex);
+		return false;
+	}
+
+	if (!(call->args & EFI_RUNTIME_ARG_SIZE)) {
+		call->status = EFI_INVALID_PARAMETER;
+	} else if (call->size < entry->size) {
+		call->size = entry->size;
+		call->status = EFI_BUFFER_TOO_SMALL;
+	} else if (!call->data) {
+		call->status = EFI_INVALID_PARAMETER;
+	} else {
+		memcpy(call->data, entry->data, entry->size);
+		call->size = entry->size;
+		call->attributes = entry->attributes;
+		call->status = EFI_SUCCESS;
+	}
+	call->answered = true;
+	call->owner->defer_stats.read_hits++;
+
+	mutex_unlock(&defer_mutex);
+
+	return true;
+}
+
+static long efi_runtime_set_deferred(struct efi_runtime_file *file,
+				     unsigned long arg)
+{
+	u32 window_ms;
+
+	if (get_user(window_ms, (u32 __user *)arg))
+		return -EFAULT;
+	if (window_ms > EFI_DEFER_WINDOW_MAX)
+		return -EINVAL;
+
+	mutex_lock(&defer_mutex);
+	file->defer_stats.window_ms = window_ms;
+	mutex_unlock(&defer_mutex);
+
+	if (!window_ms)
+		return efi_defer_sync(file);
+
+	return 0;
+}
+
+static long efi_runtime_flush(struct efi_runtime_file *file,
+			      unsigned long arg)
+{
+	struct efi_runtime_defer_stats stats;
+	u64 errors;
+	int rv;
+
+	mutex_lock(&defer_mutex);
+	errors = file->defer_stats.flush_errors;
+	mutex_unlock(&defer_mutex);
+
+	rv = efi_defer_sync(file);
+	if (rv)
+		return rv;
+
+	mutex_lock(&defer_mutex);
+	stats = file->defer_stats;
+	mutex_unlock(&defer_mutex);
+
+	if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+		return -EFAULT;
+
+	return stats.flush_errors != errors ? -EIO : 0;
+}
+
+/*
+ * Calls the driver makes on its own behalf, from internal files in the
+ * bulk class so they never hold up other callers.  Internal files wait
+ * for firmware without a deadline and their buffers are not charged.
+ */
+static void efi_internal_file_init(struct efi_runtime_file *file)
+{
+	kref_init(&file->ref);
+	file->sched_class = EFI_RUNTIME_SCHED_BULK;
+	file->sched_weight = 1;
+	INIT_LIST_HEAD(&file->sched_queue);
+	INIT_LIST_HEAD(&file->sched_active);
+}
+
+/*
+ * GetVariable on behalf of 'file', offering firmware a 'size' byte
+ * buffer, or none to only learn the size.  Returns the completed call,
+ * which the caller puts.
+ */
+static struct efi_runtime_call *
+efi_internal_get_variable(struct efi_runtime_file *file,
+			  const efi_guid_t *vendor, const efi_char16_t *name,
+			  size_t name_size, unsigned long size)
+{
+	struct efi_runtime_call *call;
+	int rv;
+
+	call = efi_runtime_call_alloc(file, EFI_RUNTIME_GET_VARIABLE);
+	if (!call)
+		return ERR_PTR(-ENOMEM);
+
+	call->name = kmemdup(name, name_size, GFP_KERNEL);
+	if (size)
+		call->data = efi_runtime_kvmalloc(size);
+	if (!call->name || (size && !call->data)) {
+		rv = -ENOMEM;
+		goto err;
+	}
+	call->vendor_guid = *vendor;
+	call->size = size;
+	call->args |= EFI_RUNTIME_ARG_GUID | EFI_RUNTIME_ARG_SIZE |
+		      EFI_RUNTIME_ARG_ATTR;
+
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		goto err;
+
+	return call;
+
+err:
+	efi_runtime_call_put(call);
+	return ERR_PTR(rv);
+}
+
+/*
+ * Step the enumeration in *vendor and *name, a buffer of *alloc bytes,
+ * on to the next variable on behalf of 'file', growing the buffer as
+ * firmware asks.  Returns 0 and the status firmware ended with, which
+ * is EFI_NOT_FOUND past the last variable.  *name is NULL after a failed
+ * dispatch, as the abandoned call keeps the buffer.
+ */
+static int efi_internal_next_variable(struct efi_runtime_file *file,
+				      efi_guid_t *vendor, efi_char16_t **name,
+				      unsigned long *alloc,
+				      efi_status_t *status)
+{
+	struct efi_runtime_call *call;
+	efi_char16_t *tmp;
+	unsigned long size;
+	int rv;
+
+	for (;;) {
+		call = efi_runtime_call_alloc(file,
+					EFI_RUNTIME_GET_NEXTVARIABLENAME);
+		if (!call)
+			return -ENOMEM;
+		call->name = *name;
+		call->size = *alloc;
+		call->vendor_guid = *vendor;
+		call->args |= EFI_RUNTIME_ARG_GUID | EFI_RUNTIME_ARG_SIZE;
+
+		rv = efi_runtime_dispatch(call);
+		if (rv) {
+			*name = NULL;
+			efi_runtime_call_put(call);
+			return rv;
+		}
+		call->name = NULL;
+		*status = call->status;
+		size = call->size;
+		if (*status == EFI_SUCCESS)
+			*vendor = call->vendor_guid;
+		efi_runtime_call_put(call);
+
+		if (*status != EFI_BUFFER_TOO_SMALL ||
+		    size <= *alloc || size > UCS2_STRSIZE_MAX)
+			return 0;
+
+		tmp = krealloc(*name, size, GFP_KERNEL);
+		if (!tmp)
+			return -ENOMEM;
+		memset((u8 *)tmp + *alloc, 0, size - *alloc);
+		*name = tmp;
+		*alloc = size;
+	}
+}
+
+/*
+ * Building and refreshing the footprint index, /proc/efi_runtime/footprint.
+ */
+static struct efi_runtime_file footprint_file;
+
+static void efi_footprint_exit(void)
+{
+	mutex_lock(&footprint_mutex);
+	efi_footprint_free();
+	mutex_unlock(&footprint_mutex);
+}
+
+/* Ask firmware for the data size of a variable without reading it */
+static int efi_footprint_query(const efi_guid_t *vendor,
+			       const efi_char16_t *name, size_t name_size,
+			       efi_status_t *status, unsigned long *size)
+{
+	struct efi_runtime_call *call;
+
+	call = efi_internal_get_variable(&footprint_file, vendor, name,
+					 name_size, 0);
+	if (IS_ERR(call))
+		return PTR_ERR(call);
+
+	*status = call->status;
+	*size = call->size;
+	efi_runtime_call_put(call);
+
+	return 0;
+}
+
+/* Add a variable found by the build, unless a write got there first */
+static int efi_footprint_add(const efi_guid_t *vendor,
+			     const efi_char16_t *name, size_t name_size)
+{
+	struct efi_footprint_var *var;
+	efi_status_t status;
+	unsigned long size;
+	u32 key;
+	int rv;
+
+	rv = efi_footprint_query(vendor, name, name_size, &status, &size);
+	if (rv)
+		return rv;
+	if (status == EFI_NOT_FOUND)
+		return 0;
+	if (status != EFI_BUFFER_TOO_SMALL && status != EFI_SUCCESS)
+		return -EIO;
+
+	key = efi_var_hash(vendor, name, name_size);
+
+	mutex_lock(&footprint_mutex);
+	if (footprint_state != FOOTPRINT_BUILDING) {
+		/* Dropped by a write that ran out of memory */
+		rv = -ENOMEM;
+	} else if (!efi_footprint_find(vendor, name, name_size, key)) {
+		var = efi_footprint_new(vendor, name, name_size, key);
+		if (var)
+			efi_footprint_resize(var, size);
+		else
+			rv = -ENOMEM;
+	}
+	mutex_unlock(&footprint_mutex);
+
+	return rv;
+}
+
+static int efi_footprint_build(void)
+{
+	efi_guid_t vendor = NULL_GUID;
+	unsigned long alloc = 1024;
+	efi_char16_t *name;
+	efi_status_t status;
+	int rv;
+
+	name = kzalloc(alloc, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	for (;;) {
+		rv = efi_internal_next_variable(&footprint_file, &vendor,
+						&name, &alloc, &status);
+		if (rv || status == EFI_NOT_FOUND)
+			break;
+		if (status != EFI_SUCCESS) {
+			rv = -EIO;
+			break;
+		}
+
+		rv = efi_footprint_add(&vendor, name,
+				       efi_ucs2_size(name, alloc));
+		if (rv)
+			break;
+	}
+
+	kfree(name);
+	return rv;
+}
+
+/* Query the sizes of variables marked stale by writes */
+static int efi_footprint_refresh(void)
+{
+	struct efi_footprint_var *var;
+	efi_char16_t *name;
+	efi_guid_t vendor;
+	efi_status_t status;
+	unsigned long size;
+	size_t name_size;
+	u32 key, seq;
+	int rv = 0;
+
+	mutex_lock(&footprint_mutex);
+	while (!rv && footprint_state == FOOTPRINT_READY &&
+	       !list_empty(&footprint_stale)) {
+		var = list_first_entry(&footprint_stale,
+				       struct efi_footprint_var, stale_node);
+		list_del_init(&var->stale_node);
+		seq = var->seq;
+		vendor = var->guid->vendor_guid;
+		name_size = var->name_size;
+		name = kmemdup(var->name, name_size, GFP_KERNEL);
+		if (!name) {
+			list_add(&var->stale_node, &footprint_stale);
+			rv = -ENOMEM;
+			break;
+		}
+		mutex_unlock(&footprint_mutex);
+
+		rv = efi_footprint_query(&vendor, name, name_size, &status,
+					 &size);
+		key = efi_var_hash(&vendor, name, name_size);
+
+		mutex_lock(&footprint_mutex);
+		/* A write since has either set the size or marked it again */
+		var = efi_footprint_find(&vendor, name, name_size, key);
+		if (var && var->seq == seq) {
+			if (rv)
+				list_add(&var->stale_node, &footprint_stale);
+			else if (status == EFI_NOT_FOUND)
+				efi_footprint_remove(var);
+			else if (status == EFI_BUFFER_TOO_SMALL ||
+				 status == EFI_SUCCESS)
+				efi_footprint_resize(var, size);
+		}
+		kfree(name);
+	}
+	mutex_unlock(&footprint_mutex);
+
+	return rv;
+}
+
+/* Build the index if needed and bring it up to date */
+static int efi_footprint_scan(void)
+{
+	int state, rv = 0;
+
+	if (mutex_lock_interruptible(&footprint_scan_mutex))
+		return -EINTR;
+
+	mutex_lock(&footprint_mutex);
+	state = footprint_state;
+	if (state == FOOTPRINT_EMPTY)
+		footprint_state = FOOTPRINT_BUILDING;
+	mutex_unlock(&footprint_mutex);
+
+	if (state == FOOTPRINT_EMPTY) {
+		rv = efi_footprint_build();
+
+		mutex_lock(&footprint_mutex);
+		if (!rv && footprint_state != FOOTPRINT_BUILDING)
+			rv = -ENOMEM;
+		if (rv)
+			efi_footprint_free();
+		else
+			footprint_state = FOOTPRINT_READY;
+		mutex_unlock(&footprint_mutex);
+	}
+
+	if (!rv)
+		rv = efi_footprint_refresh();
+
+	mutex_unlock(&footprint_scan_mutex);
+	return rv;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
+/* Non-volatile storage totals, through the QueryVariableInfo cache */
+static void efi_footprint_show_storage(struct seq_file *m)
+{
+	struct efi_runtime_call *call;
+	u64 gen;
+
+	call = efi_runtime_call_alloc(&footprint_file,
+				      EFI_RUNTIME_QUERY_VARIABLEINFO);
+	if (!call)
+		return;
+
+	call->attributes = EFI_VARIABLE_NON_VOLATILE |
+			   EFI_VARIABLE_BOOTSERVICE_ACCESS |
+			   EFI_VARIABLE_RUNTIME_ACCESS;
+
+	if (!efi_qvi_lookup(call)) {
+		gen = efi_qvi_generation();
+		if (efi_runtime_dispatch(call))
+			goto out;
+		if (call->status == EFI_SUCCESS)
+			efi_qvi_store(call, gen);
+	}
+
+	if (call->status == EFI_SUCCESS) {
+		seq_printf(m, "storage_size: %llu\n", call->max_storage);
+		seq_printf(m, "storage_remaining: %llu\n", call->remaining);
+		seq_printf(m, "max_variable_size: %llu\n", call->max_size);
+	}
+
+out:
+	efi_runtime_call_put(call);
+}
+#else
+static void efi_footprint_show_storage(struct seq_file *m)
+{
+}
+#endif
+
+static int efi_footprint_show(struct seq_file *m, void *v)
+{
+	struct efi_footprint_guid *guid;
+	u64 bytes = 0;
+	u32 count = 0;
+	int rv;
+
+	rv = efi_footprint_scan();
+	if (rv)
+		return rv;
+
+	efi_footprint_show_storage(m);
+
+	mutex_lock(&footprint_mutex);
+	if (footprint_state != FOOTPRINT_READY) {
+		/* Dropped and being built again since the scan */
+		mutex_unlock(&footprint_mutex);
+		return -EAGAIN;
+	}
+	list_for_each_entry(guid, &footprint_guids, node) {
+		count += guid->count;
+		bytes += guid->bytes;
+	}
+	seq_printf(m, "variables: %u\n", count);
+	seq_printf(m, "variable_bytes: %llu\n", bytes);
+
+	seq_printf(m, "%-36s %9s %10s %8s\n",
+		   "guid", "variables", "bytes", "largest");
+	list_for_each_entry(guid, &footprint_guids, node) {
+		if (!guid->count)
+			continue;
+		seq_printf(m, "%pUl %9u %10llu %8lu\n", &guid->vendor_guid,
+			   guid->count, guid->bytes, guid->largest);
+	}
+	mutex_unlock(&footprint_mutex);
+
+	return 0;
+}
+
+/*
+ * Read cache warm-up.
+ *
+ * A work item walks the variable store and reads the variables of the
+ * vendors in warmup_guids, or of all vendors, into the read cache, so
+ * the first audit after boot doesn't pay for cold firmware.  It starts
+ * at load with warmup=1 or on EFI_RUNTIME_WARMUP.  Calls go out from an
+ * internal bulk-class file and a variable at most every
+ * warmup_interval_ms, so other callers always get firmware first.
+ */
+static bool warmup;
+module_param(warmup, bool, 0444);
+MODULE_PARM_DESC(warmup, "Warm the variable read cache up after loading");
+
+static char *warmup_guids;
+module_param(warmup_guids, charp, 0444);
+MODULE_PARM_DESC(warmup_guids,
+		 "Comma separated vendor GUIDs to warm up, all if unset");
+
+static unsigned int warmup_interval_ms = 10;
+module_param(warmup_interval_ms, uint, 0644);
+MODULE_PARM_DESC(warmup_interval_ms,
+		 "Pause between variables read by the warm-up in ms");
+
+#define EFI_WARMUP_GUIDS_MAX	16
+#define EFI_WARMUP_READ_SIZE	1024
+
+/* warmup_state.state */
+enum {
+	WARMUP_IDLE,
+	WARMUP_RUNNING,
+	WARMUP_DONE,
+	WARMUP_STOPPED,
+	WARMUP_FAILED,
+};
+
+static const char * const warmup_state_names[] = {
+	[WARMUP_IDLE]		= "idle",
+	[WARMUP_RUNNING]	= "running",
+	[WARMUP_DONE]		= "done",
+	[WARMUP_STOPPED]	= "stopped",
+	[WARMUP_FAILED]		= "failed",
+};
+
+static struct efi_runtime_file warmup_file;
+static efi_guid_t warmup_guid_list[EFI_WARMUP_GUIDS_MAX];
+static unsigned int warmup_nr_guids;
+static DEFINE_MUTEX(warmup_mutex);
+static DECLARE_WAIT_QUEUE_HEAD(warmup_wait);
+
+static struct {
+	struct work_struct	work;
+	int			state;
+	bool			stop;
+	unsigned int		variables;	/* enumerated */
+	unsigned int		cached;
+	unsigned int		skipped;	/* gone, too big or written */
+	unsigned int		errors;
+	unsigned long		started;
+	unsigned long		finished;
+} warmup_state;
+
+static int efi_warmup_parse_guids(void)
+{
+	const char *str = warmup_guids;
+	u8 d[8];
+	u16 b, c;
+	u32 a;
+	int n;
+
+	if (!str || !*str)
+		return 0;
+
+	for (;;) {
+		n = 0;
+		if (warmup_nr_guids == EFI_WARMUP_GUIDS_MAX ||
+		    sscanf(str, "%8x-%4hx-%4hx-%2hhx%2hhx-%2hhx%2hhx%2hhx%2hhx%2hhx%2hhx%n",
+			   &a, &b, &c, &d[0], &d[1], &d[2], &d[3], &d[4],
+			   &d[5], &d[6], &d[7], &n) != 11 || n != 36)
+			break;
+
+		warmup_guid_list[warmup_nr_guids++] =
+			EFI_GUID(a, b, c, d[0], d[1], d[2], d[3], d[4], d[5],
+				 d[6], d[7]);
+
+		str += n;
+		if (!*str)
+			return 0;
+		if (*str++ != ',')
+			break;
+	}
+
+	pr_err("efi_runtime: bad warmup_guids %s\n", warmup_guids);
+	return -EINVAL;
+}
+
+/* Counters are read by the stats file, so they change under the mutex */
+static void efi_warmup_count(unsigned int *counter)
+{
+	mutex_lock(&warmup_mutex);
+	(*counter)++;
+	mutex_unlock(&warmup_mutex);
+}
+
+static bool efi_warmup_wanted(const efi_guid_t *vendor)
+{
+	unsigned int i;
+
+	if (!warmup_nr_guids)
+		return true;
+
+	for (i = 0; i < warmup_nr_guids; i++) {
+		if (!efi_guidcmp(warmup_guid_list[i], *vendor))
+			return true;
+	}
+	return false;
+}
+
+static void efi_warmup_read(const efi_guid_t *vendor,
+			    const efi_char16_t *name, size_t name_size)
+{
+	size_t max = efi_kb_to_bytes(READ_ONCE(read_cache_max_kb));
+	u64 gen = efi_read_cache_generation();
+	struct efi_runtime_call *call;
+	unsigned long size;
+	int rv;
+
+	call = efi_internal_get_variable(&warmup_file, vendor, name,
+					 name_size, EFI_WARMUP_READ_SIZE);
+	if (!IS_ERR(call) && call->status == EFI_BUFFER_TOO_SMALL) {
+		size = call->size;
+		efi_runtime_call_put(call);
+		if (size > max) {
+			efi_warmup_count(&warmup_state.skipped);
+			return;
+		}
+		call = efi_internal_get_variable(&warmup_file, vendor, name,
+						 name_size, size);
+	}
+	if (IS_ERR(call)) {
+		efi_warmup_count(&warmup_state.errors);
+		return;
+	}
 
-	if (get_user(c, s++)) {
-		/* Can't read userspace memory for size */
-		return 0;
+	if (call->status == EFI_SUCCESS) {
+		rv = efi_read_cache_insert(vendor, name, name_size,
+					   call->attributes, call->data,
+					   call->size, gen);
+		if (!rv)
+			efi_warmup_count(&warmup_state.cached);
+		else if (rv == -ENOMEM)
+			efi_warmup_count(&warmup_state.errors);
+		else
+			efi_warmup_count(&warmup_state.skipped);
+	} else if (call->status == EFI_NOT_FOUND) {
+		efi_warmup_count(&warmup_state.skipped);
+	} else {
+		efi_warmup_count(&warmup_state.errors);
 	}
 
-	while (c != 0) {
-		if (get_user(c, s++)) {
-			/* Can't read userspace memory for size */
-			return 0;
+	efi_runtime_call_put(call);
+}
+
+static void efi_warmup_work(struct work_struct *work)
+{
+	efi_guid_t vendor = NULL_GUID;
+	unsigned long alloc = 1024;
+	unsigned int cached, variables, ms;
+	efi_char16_t *name;
+	efi_status_t status;
+	int state, rv;
+
+	name = kzalloc(alloc, GFP_KERNEL);
+	rv = name ? 0 : -ENOMEM;
+
+	while (!rv && !READ_ONCE(warmup_state.stop)) {
+		rv = efi_internal_next_variable(&warmup_file, &vendor, &name,
+						&alloc, &status);
+		if (rv || status == EFI_NOT_FOUND)
+			break;
+		if (status != EFI_SUCCESS) {
+			rv = -EIO;
+			break;
 		}
-		len += sizeof(efi_char16_t);
+
+		efi_warmup_count(&warmup_state.variables);
+		if (efi_warmup_wanted(&vendor))
+			efi_warmup_read(&vendor, name,
+					efi_ucs2_size(name, alloc));
+
+		wait_event_timeout(warmup_wait, READ_ONCE(warmup_state.stop),
+			msecs_to_jiffies(READ_ONCE(warmup_interval_ms)));
 	}
-	return len;
+	kfree(name);
+
+	if (rv)
+		state = WARMUP_FAILED;
+	else if (READ_ONCE(warmup_state.stop))
+		state = WARMUP_STOPPED;
+	else
+		state = WARMUP_DONE;
+
+	/* A new warm-up may start as soon as this one is published */
+	mutex_lock(&warmup_mutex);
+	warmup_state.state = state;
+	warmup_state.finished = jiffies;
+	cached = warmup_state.cached;
+	variables = warmup_state.variables;
+	ms = jiffies_to_msecs(warmup_state.finished - warmup_state.started);
+	mutex_unlock(&warmup_mutex);
+
+	pr_info("efi_runtime: warm-up %s, cached %u of %u variables in %u ms\n",
+		warmup_state_names[state], cached, variables, ms);
 }
 
-/*
- * Allocate a buffer and copy a ucs2 string from user space into it.
- */
-static inline int
-copy_ucs2_from_user_len(efi_char16_t **dst, efi_char16_t __user *src,
-			size_t len)
+static int efi_warmup_start(void)
 {
-	efi_char16_t *buf;
+	int rv = 0;
 
-	if (!src) {
-		*dst = NULL;
-		return 0;
+	mutex_lock(&warmup_mutex);
+	if (warmup_state.state == WARMUP_RUNNING) {
+		rv = -EBUSY;
+	} else {
+		warmup_state.state = WARMUP_RUNNING;
+		warmup_state.variables = 0;
+		warmup_state.cached = 0;
+		warmup_state.skipped = 0;
+		warmup_state.errors = 0;
+		warmup_state.started = jiffies;
+		queue_work(system_long_wq, &warmup_state.work);
 	}
+	mutex_unlock(&warmup_mutex);
 
-	if (!ACCESS_OK(VERIFY_READ, src, 1))
-		return -EFAULT;
+	return rv;
+}
 
-	buf = memdup_user(src, len);
-	if (IS_ERR(buf)) {
-		*dst = NULL;
-		return PTR_ERR(buf);
-	}
-	*dst = buf;
+static int efi_warmup_init(void)
+{
+	efi_internal_file_init(&warmup_file);
+	INIT_WORK(&warmup_state.work, efi_warmup_work);
 
-	return 0;
+	return efi_warmup_parse_guids();
+}
+
+static void efi_warmup_exit(void)
+{
+	WRITE_ONCE(warmup_state.stop, true);
+	wake_up(&warmup_wait);
+	cancel_work_sync(&warmup_state.work);
+}
+
+static void efi_warmup_show(struct seq_file *m)
+{
+	unsigned long end;
+	int state;
+
+	mutex_lock(&warmup_mutex);
+	state = warmup_state.state;
+	end = state == WARMUP_RUNNING ? jiffies : warmup_state.finished;
+	seq_printf(m, "warmup_state: %s\n", warmup_state_names[state]);
+	seq_printf(m, "warmup_variables: %u\n", warmup_state.variables);
+	seq_printf(m, "warmup_cached: %u\n", warmup_state.cached);
+	seq_printf(m, "warmup_skipped: %u\n", warmup_state.skipped);
+	seq_printf(m, "warmup_errors: %u\n", warmup_state.errors);
+	seq_printf(m, "warmup_ms: %u\n", state == WARMUP_IDLE ? 0 :
+		   jiffies_to_msecs(end - warmup_state.started));
+	mutex_unlock(&warmup_mutex);
 }
 
 /*
- * Count the bytes in 'str', including the terminating NULL.
- *
- * Just a wrap for user_ucs2_strsize
+ * Driver statistics, /proc/efi_runtime/stats.
  */
-static inline int
-get_ucs2_strsize_from_user(efi_char16_t __user *src, size_t *len)
-{
-	if (!ACCESS_OK(VERIFY_READ, src, 1))
-		return -EFAULT;
+static struct proc_dir_entry *efi_runtime_proc;
 
-	*len = user_ucs2_strsize(src);
-	if (*len == 0)
-		return -EFAULT;
+static int efi_runtime_stats_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "calls: %lld\n",
+		   atomic64_read(&worker_stats.calls));
+	seq_printf(m, "queue_timeouts: %lld\n",
+		   atomic64_read(&worker_stats.queue_timeouts));
+	seq_printf(m, "firmware_timeouts: %lld\n",
+		   atomic64_read(&worker_stats.firmware_timeouts));
+	seq_printf(m, "interrupted: %lld\n",
+		   atomic64_read(&worker_stats.interrupted));
+	seq_printf(m, "late_completions: %lld\n",
+		   atomic64_read(&worker_stats.late_completions));
+	seq_printf(m, "max_firmware_ns: %lld\n",
+		   atomic64_read(&worker_stats.max_firmware_ns));
+
+	seq_printf(m, "qvi_cache_hits: %lld\n",
+		   atomic64_read(&qvi_stats.hits));
+	seq_printf(m, "qvi_cache_misses: %lld\n",
+		   atomic64_read(&qvi_stats.misses));
+	seq_printf(m, "qvi_cache_invalidations: %lld\n",
+		   atomic64_read(&qvi_stats.invalidations));
+
+	seq_printf(m, "deferred_writes: %lld\n",
+		   atomic64_read(&defer_stats.writes));
+	seq_printf(m, "deferred_coalesced: %lld\n",
+		   atomic64_read(&defer_stats.coalesced));
+	seq_printf(m, "deferred_flushed: %lld\n",
+		   atomic64_read(&defer_stats.flushed));
+	seq_printf(m, "deferred_flush_errors: %lld\n",
+		   atomic64_read(&defer_stats.flush_errors));
+	seq_printf(m, "deferred_pending: %d\n", atomic_read(&defer_count));
+
+	seq_printf(m, "buffer_allocs: %lld\n",
+		   atomic64_read(&mem_stats.allocs));
+	seq_printf(m, "buffer_vmallocs: %lld\n",
+		   atomic64_read(&mem_stats.vmallocs));
+	seq_printf(m, "buffer_bytes: %lld\n",
+		   atomic64_read(&mem_stats.bytes));
+	seq_printf(m, "buffer_oversized: %lld\n",
+		   atomic64_read(&mem_stats.oversized));
+	seq_printf(m, "buffer_over_budget: %lld\n",
+		   atomic64_read(&mem_stats.over_budget));
+
+	seq_printf(m, "read_cache_hits: %lld\n",
+		   atomic64_read(&read_cache_stats.hits));
+	seq_printf(m, "read_cache_misses: %lld\n",
+		   atomic64_read(&read_cache_stats.misses));
+	seq_printf(m, "read_cache_invalidations: %lld\n",
+		   atomic64_read(&read_cache_stats.invalidations));
+	seq_printf(m, "read_cache_entries: %u\n",
+		   READ_ONCE(read_cache_entries));
+	seq_printf(m, "read_cache_bytes: %zu\n", READ_ONCE(read_cache_bytes));
+	efi_warmup_show(m);
+
+	if (efi_rt == &efi_emu_ops) {
+		seq_printf(m, "emu_delay_us: %lld\n",
+			   atomic64_read(&emu_stats.delay_us));
+		seq_printf(m, "emu_spikes: %lld\n",
+			   atomic64_read(&emu_stats.spikes));
+		seq_printf(m, "emu_gc_stalls: %lld\n",
+			   atomic64_read(&emu_stats.gc_stalls));
+		seq_printf(m, "emu_reclaim_stalls: %lld\n",
+			   atomic64_read(&emu_stats.reclaim_stalls));
+	}
 
 	return 0;
 }
 
-/*
- * Calculate the required buffer allocation size and copy a ucs2 string
- * from user space into it.
- *
- * This function differs from copy_ucs2_from_user_len() because it
- * calculates the size of the buffer to allocate by taking the length of
- * the string 'src'.
- *
- * If a non-zero value is returned, the caller MUST NOT access 'dst'.
- *
- * It is the caller's responsibility to free 'dst'.
- */
-static inline int
-copy_ucs2_from_user(efi_char16_t **dst, efi_char16_t __user *src)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+#define efi_runtime_proc_create(name, mode, show) \
+	proc_create_single(name, mode, efi_runtime_proc, show)
+#else
+static int efi_runtime_proc_open(struct inode *inode, struct file *file)
 {
-	size_t len;
+	return single_open(file, PDE_DATA(inode), NULL);
+}
 
-	if (!ACCESS_OK(VERIFY_READ, src, 1))
-		return -EFAULT;
+static const struct file_operations efi_runtime_proc_fops = {
+	.owner		= THIS_MODULE,
+	.open		= efi_runtime_proc_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-	len = user_ucs2_strsize(src);
-	if (len == 0)
-		return -EFAULT;
-	return copy_ucs2_from_user_len(dst, src, len);
+#define efi_runtime_proc_create(name, mode, show) \
+	proc_create_data(name, mode, efi_runtime_proc, \
+			 &efi_runtime_proc_fops, show)
+#endif
+
+static int efi_runtime_proc_init(void)
+{
+	efi_runtime_proc = proc_mkdir("efi_runtime", NULL);
+	if (!efi_runtime_proc)
+		return -ENOMEM;
+
+	/*
+	 * The image holds every variable, secrets included, and reading
+	 * footprint enumerates the whole store in firmware.
+	 */
+	if (!efi_runtime_proc_create("stats", 0444, efi_runtime_stats_show) ||
+	    !efi_runtime_proc_create("footprint", 0400, efi_footprint_show) ||
+	    (efi_runtime_emulated() &&
+	     !efi_runtime_proc_create("emu_image", 0400,
+				      efi_emu_image_show))) {
+		proc_remove(efi_runtime_proc);
+		return -ENOMEM;
+	}
+
+	return 0;
 }
 
 /*
- * Copy a ucs2 string to a user buffer.
- *
- * This function is a simple wrapper around copy_to_user() that does
- * nothing if 'src' is NULL, which is useful for reducing the amount of
- * NULL checking the caller has to do.
- *
- * 'len' specifies the number of bytes to copy.
+ * Copy the ucs2 name argument of 'call' from user space into a charged
+ * buffer of 'len' bytes, or of the string's size if 'len' is 0.  The
+ * name must be terminated within the buffer, or firmware would read
+ * past its end.
  */
-static inline int
-copy_ucs2_to_user_len(efi_char16_t __user *dst, efi_char16_t *src, size_t len)
+static int efi_runtime_call_name(struct efi_runtime_call *call,
+				 efi_char16_t __user *src, size_t len)
 {
-	if (!src)
-		return 0;
+	efi_char16_t *name;
+	size_t size;
+	int rv;
 
-	if (!ACCESS_OK(VERIFY_WRITE, dst, 1))
-		return -EFAULT;
+	if (!len) {
+		rv = get_ucs2_strsize_from_user(src, &len);
+		if (rv)
+			return rv;
+	}
+	if (len < sizeof(efi_char16_t))
+		return -EINVAL;
+
+	name = efi_runtime_call_buf_user(call, src, len);
+	if (IS_ERR(name))
+		return PTR_ERR(name);
+
+	size = efi_ucs2_size(name, len);
+	if (!size || name[size / sizeof(efi_char16_t) - 1]) {
+		kvfree(name);
+		return -EINVAL;
+	}
 
-	return copy_to_user(dst, src, len);
+	call->name = name;
+	return 0;
 }
 
-static long efi_runtime_get_variable(unsigned long arg)
+static long efi_runtime_get_variable(struct efi_runtime_call *call,
+				     unsigned long arg, bool fresh)
 {
 	struct efi_getvariable __user *getvariable_user;
 	struct efi_getvariable getvariable;
-	unsigned long datasize = 0, prev_datasize, *dz;
-	efi_guid_t vendor_guid, *vd = NULL;
+	unsigned long prev_datasize, user_datasize;
 	efi_status_t status;
-	efi_char16_t *name = NULL;
-	u32 attr, *at;
-	void *data = NULL;
-	int rv = 0;
+	void *data;
+	int rv;
 
 	getvariable_user = (struct efi_getvariable __user *)arg;
 
 	if (copy_from_user(&getvariable, getvariable_user,
 			   sizeof(getvariable)))
 		return -EFAULT;
-	if (getvariable.data_size &&
-	    get_user(datasize, getvariable.data_size))
-		return -EFAULT;
+	if (getvariable.data_size) {
+		if (get_user(call->size, getvariable.data_size))
+			return -EFAULT;
+		call->args |= EFI_RUNTIME_ARG_SIZE;
+	}
 	if (getvariable.vendor_guid) {
-		if (copy_from_user(&vendor_guid, getvariable.vendor_guid,
-					sizeof(vendor_guid)))
+		if (copy_from_user(&call->vendor_guid, getvariable.vendor_guid,
+					sizeof(efi_guid_t)))
 			return -EFAULT;
-		vd = &vendor_guid;
+		call->args |= EFI_RUNTIME_ARG_GUID;
 	}
 
 	if (getvariable.variable_name) {
-		rv = copy_ucs2_from_user(&name, getvariable.variable_name);
+		rv = efi_runtime_call_name(call, getvariable.variable_name, 0);
 		if (rv)
 			return rv;
 	}
 
-	at = getvariable.attributes ? &attr : NULL;
-	dz = getvariable.data_size ? &datasize : NULL;
+	if (getvariable.attributes)
+		call->args |= EFI_RUNTIME_ARG_ATTR;
+
+	/*
+	 * The size is only the capacity of the caller's buffer, so firmware
+	 * is offered at most payload_max_kb of it.
+	 */
+	user_datasize = call->size;
+	if (call->size > efi_runtime_payload_max())
+		call->size = efi_runtime_payload_max();
 
 	if (getvariable.data_size && getvariable.data) {
-		data = kmalloc(datasize, GFP_KERNEL);
-		if (!data) {
-			kfree(name);
-			return -ENOMEM;
-		}
+		data = efi_runtime_call_buf(call, call->size);
+		if (IS_ERR(data))
+			return PTR_ERR(data);
+		call->data = data;
 	}
 
-	prev_datasize = datasize;
-	status = efi.get_variable(name, vd, at, dz, data);
-	kfree(name);
-
-	if (put_user(status, getvariable.status)) {
-		rv = -EFAULT;
-		goto out;
+	prev_datasize = call->size;
+	/* A buffered write is newer than firmware, so even fresh reads see it */
+	if (!efi_defer_read(call) &&
+	    (fresh || !efi_read_cache_lookup(call))) {
+		rv = efi_runtime_dispatch(call);
+		if (rv)
+			return rv;
 	}
+	status = call->status;
 
-	if (status != EFI_SUCCESS) {
-		if (status == EFI_BUFFER_TOO_SMALL) {
-			if (dz && put_user(datasize, getvariable.data_size)) {
-				rv = -EFAULT;
-				goto out;
-			}
-		}
-		rv = -EINVAL;
-		goto out;
+	/*
+	 * Only too small for the capacity firmware was offered.  No status
+	 * is written, so the caller doesn't take it for BUFFER_TOO_SMALL
+	 * and retry with the same buffer.
+	 */
+	if (status == EFI_BUFFER_TOO_SMALL && call->size <= user_datasize) {
+		atomic64_inc(&mem_stats.oversized);
+		return -E2BIG;
 	}
 
-	if (prev_datasize < datasize) {
-		rv = -EINVAL;
-		goto out;
-	}
+	if (put_user(status, getvariable.status))
+		return -EFAULT;
 
-	if (data) {
-		if (copy_to_user(getvariable.data, data, datasize)) {
-			rv = -EFAULT;
-			goto out;
-		}
+	if (status != EFI_SUCCESS) {
+		if (status == EFI_BUFFER_TOO_SMALL &&
+		    getvariable.data_size &&
+		    put_user(call->size, getvariable.data_size))
+			return -EFAULT;
+		return -EINVAL;
 	}
 
-	if (at && put_user(attr, getvariable.attributes)) {
-		rv = -EFAULT;
-		goto out;
+	if (prev_datasize < call->size)
+		return -EINVAL;
+
+	if (call->data) {
+		if (copy_to_user(getvariable.data, call->data, call->size))
+			return -EFAULT;
 	}
 
-	if (dz && put_user(datasize, getvariable.data_size))
-		rv = -EFAULT;
+	if (getvariable.attributes &&
+	    put_user(call->attributes, getvariable.attributes))
+		return -EFAULT;
 
-out:
-	kfree(data);
-	return rv;
+	if (getvariable.data_size &&
+	    put_user(call->size, getvariable.data_size))
+		return -EFAULT;
 
+	return 0;
 }
 
-static long efi_runtime_set_variable(unsigned long arg)
+static long efi_runtime_set_variable(struct efi_runtime_call *call,
+				     unsigned long arg)
 {
 	struct efi_setvariable __user *setvariable_user;
 	struct efi_setvariable setvariable;
-	efi_guid_t vendor_guid;
 	efi_status_t status;
-	efi_char16_t *name = NULL;
 	void *data;
-	int rv = 0;
+	int rv;
 
 	setvariable_user = (struct efi_setvariable __user *)arg;
 
 	if (copy_from_user(&setvariable, setvariable_user, sizeof(setvariable)))
 		return -EFAULT;
-	if (copy_from_user(&vendor_guid, setvariable.vendor_guid,
-				sizeof(vendor_guid)))
+	if (copy_from_user(&call->vendor_guid, setvariable.vendor_guid,
+				sizeof(efi_guid_t)))
 		return -EFAULT;
+	call->args |= EFI_RUNTIME_ARG_GUID;
 
 	if (setvariable.variable_name) {
-		rv = copy_ucs2_from_user(&name, setvariable.variable_name);
+		rv = efi_runtime_call_name(call, setvariable.variable_name, 0);
 		if (rv)
 			return rv;
 	}
 
-	data = memdup_user(setvariable.data, setvariable.data_size);
-	if (IS_ERR(data)) {
-		kfree(name);
+	data = efi_runtime_call_buf_user(call, setvariable.data,
+					 setvariable.data_size);
+	if (IS_ERR(data))
 		return PTR_ERR(data);
+	call->data = data;
+	call->attributes = setvariable.attributes;
+	call->size = setvariable.data_size;
+
+	rv = efi_defer_write(call);
+	if (rv < 0)
+		return rv;
+	if (rv) {
+		/* Buffered, firmware sees it on the next flush */
+		status = call->status;
+	} else {
+		rv = efi_runtime_dispatch(call);
+		if (rv)
+			return rv;
+		status = call->status;
 	}
 
-	status = efi.set_variable(name, &vendor_guid,
-				setvariable.attributes,
-				setvariable.data_size, data);
-
-	if (put_user(status, setvariable.status)) {
-		rv = -EFAULT;
-		goto out;
-	}
-
-	rv = status == EFI_SUCCESS ? 0 : -EINVAL;
-
-out:
-	kfree(data);
-	kfree(name);
+	if (put_user(status, setvariable.status))
+		return -EFAULT;
 
-	return rv;
+	return status == EFI_SUCCESS ? 0 : -EINVAL;
 }
 
-static long efi_runtime_get_time(unsigned long arg)
+static long efi_runtime_get_time(struct efi_runtime_call *call,
+				 unsigned long arg)
 {
 	struct efi_gettime __user *gettime_user;
 	struct efi_gettime  gettime;
 	efi_status_t status;
-	efi_time_cap_t cap;
-	efi_time_t efi_time;
+	int rv;
 
 	gettime_user = (struct efi_gettime __user *)arg;
 	if (copy_from_user(&gettime, gettime_user, sizeof(gettime)))
 		return -EFAULT;
 
-	status = efi.get_time(gettime.time ? &efi_time : NULL,
-			      gettime.capabilities ? &cap : NULL);
+	if (gettime.time)
+		call->args |= EFI_RUNTIME_ARG_TIME;
+	if (gettime.capabilities)
+		call->args |= EFI_RUNTIME_ARG_CAP;
+
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
 	if (put_user(status, gettime.status))
 		return -EFAULT;
@@ -334,33 +4549,43 @@ static long efi_runtime_get_time(unsigned long arg)
 		efi_time_cap_t __user *cap_local;
 
 		cap_local = (efi_time_cap_t *)gettime.capabilities;
-		if (put_user(cap.resolution, &(cap_local->resolution)) ||
-			put_user(cap.accuracy, &(cap_local->accuracy)) ||
-			put_user(cap.sets_to_zero, &(cap_local->sets_to_zero)))
+		if (put_user(call->cap.resolution,
+				&(cap_local->resolution)) ||
+			put_user(call->cap.accuracy,
+				&(cap_local->accuracy)) ||
+			put_user(call->cap.sets_to_zero,
+				&(cap_local->sets_to_zero)))
 			return -EFAULT;
 	}
 	if (gettime.time) {
-		if (copy_to_user(gettime.time, &efi_time, sizeof(efi_time_t)))
+		if (copy_to_user(gettime.time, &call->time,
+				sizeof(efi_time_t)))
 			return -EFAULT;
 	}
 
 	return 0;
 }
 
-static long efi_runtime_set_time(unsigned long arg)
+static long efi_runtime_set_time(struct efi_runtime_call *call,
+				 unsigned long arg)
 {
 	struct efi_settime __user *settime_user;
 	struct efi_settime settime;
 	efi_status_t status;
-	efi_time_t efi_time;
+	int rv;
 
 	settime_user = (struct efi_settime __user *)arg;
 	if (copy_from_user(&settime, settime_user, sizeof(settime)))
 		return -EFAULT;
-	if (copy_from_user(&efi_time, settime.time,
+	if (copy_from_user(&call->time, settime.time,
 					sizeof(efi_time_t)))
 		return -EFAULT;
-	status = efi.set_time(&efi_time);
+	call->args |= EFI_RUNTIME_ARG_TIME;
+
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
 	if (put_user(status, settime.status))
 		return -EFAULT;
@@ -368,23 +4593,30 @@ static long efi_runtime_set_time(unsigned long arg)
 	return status == EFI_SUCCESS ? 0 : -EINVAL;
 }
 
-static long efi_runtime_get_waketime(unsigned long arg)
+static long efi_runtime_get_waketime(struct efi_runtime_call *call,
+				     unsigned long arg)
 {
 	struct efi_getwakeuptime __user *getwakeuptime_user;
 	struct efi_getwakeuptime getwakeuptime;
-	efi_bool_t enabled, pending;
 	efi_status_t status;
-	efi_time_t efi_time;
+	int rv;
 
 	getwakeuptime_user = (struct efi_getwakeuptime __user *)arg;
 	if (copy_from_user(&getwakeuptime, getwakeuptime_user,
 				sizeof(getwakeuptime)))
 		return -EFAULT;
 
-	status = efi.get_wakeup_time(
-		getwakeuptime.enabled ? (efi_bool_t *)&enabled : NULL,
-		getwakeuptime.pending ? (efi_bool_t *)&pending : NULL,
-		getwakeuptime.time ? &efi_time : NULL);
+	if (getwakeuptime.enabled)
+		call->args |= EFI_RUNTIME_ARG_ENABLED;
+	if (getwakeuptime.pending)
+		call->args |= EFI_RUNTIME_ARG_PENDING;
+	if (getwakeuptime.time)
+		call->args |= EFI_RUNTIME_ARG_TIME;
+
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
 	if (put_user(status, getwakeuptime.status))
 		return -EFAULT;
@@ -392,12 +4624,12 @@ static long efi_runtime_get_waketime(unsigned long arg)
 	if (status != EFI_SUCCESS)
 		return -EINVAL;
 
-	if (getwakeuptime.enabled && put_user(enabled,
+	if (getwakeuptime.enabled && put_user(call->enabled,
 						getwakeuptime.enabled))
 		return -EFAULT;
 
 	if (getwakeuptime.time) {
-		if (copy_to_user(getwakeuptime.time, &efi_time,
+		if (copy_to_user(getwakeuptime.time, &call->time,
 				sizeof(efi_time_t)))
 			return -EFAULT;
 	}
@@ -405,13 +4637,13 @@ static long efi_runtime_get_waketime(unsigned long arg)
 	return 0;
 }
 
-static long efi_runtime_set_waketime(unsigned long arg)
+static long efi_runtime_set_waketime(struct efi_runtime_call *call,
+				     unsigned long arg)
 {
 	struct efi_setwakeuptime __user *setwakeuptime_user;
 	struct efi_setwakeuptime setwakeuptime;
-	efi_bool_t enabled;
 	efi_status_t status;
-	efi_time_t efi_time;
+	int rv;
 
 	setwakeuptime_user = (struct efi_setwakeuptime __user *)arg;
 
@@ -419,15 +4651,18 @@ static long efi_runtime_set_waketime(unsigned long arg)
 				sizeof(setwakeuptime)))
 		return -EFAULT;
 
-	enabled = setwakeuptime.enabled;
+	call->enabled = setwakeuptime.enabled;
 	if (setwakeuptime.time) {
-		if (copy_from_user(&efi_time, setwakeuptime.time,
+		if (copy_from_user(&call->time, setwakeuptime.time,
 					sizeof(efi_time_t)))
 			return -EFAULT;
+		call->args |= EFI_RUNTIME_ARG_TIME;
+	}
 
-		status = efi.set_wakeup_time(enabled, &efi_time);
-	} else
-		status = efi.set_wakeup_time(enabled, NULL);
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
 	if (put_user(status, setwakeuptime.status))
 		return -EFAULT;
@@ -435,16 +4670,14 @@ static long efi_runtime_set_waketime(unsigned long arg)
 	return status == EFI_SUCCESS ? 0 : -EINVAL;
 }
 
-static long efi_runtime_get_nextvariablename(unsigned long arg)
+static long efi_runtime_get_nextvariablename(struct efi_runtime_call *call,
+					     unsigned long arg)
 {
 	struct efi_getnextvariablename __user *getnextvariablename_user;
 	struct efi_getnextvariablename getnextvariablename;
-	unsigned long name_size, prev_name_size = 0, *ns = NULL;
+	unsigned long prev_name_size = 0;
 	efi_status_t status;
-	efi_guid_t *vd = NULL;
-	efi_guid_t vendor_guid;
-	efi_char16_t *name = NULL;
-	int rv = 0;
+	int rv;
 
 	getnextvariablename_user = (struct efi_getnextvariablename __user *)arg;
 
@@ -453,18 +4686,19 @@ static long efi_runtime_get_nextvariablename(unsigned long arg)
 		return -EFAULT;
 
 	if (getnextvariablename.variable_name_size) {
-		if (get_user(name_size, getnextvariablename.variable_name_size))
+		if (get_user(call->size,
+			     getnextvariablename.variable_name_size))
 			return -EFAULT;
-		ns = &name_size;
-		prev_name_size = name_size;
+		call->args |= EFI_RUNTIME_ARG_SIZE;
+		prev_name_size = call->size;
 	}
 
 	if (getnextvariablename.vendor_guid) {
-		if (copy_from_user(&vendor_guid,
+		if (copy_from_user(&call->vendor_guid,
 				getnextvariablename.vendor_guid,
-				sizeof(vendor_guid)))
+				sizeof(efi_guid_t)))
 			return -EFAULT;
-		vd = &vendor_guid;
+		call->args |= EFI_RUNTIME_ARG_GUID;
 	}
 
 	if (getnextvariablename.variable_name) {
@@ -483,7 +4717,7 @@ static long efi_runtime_get_nextvariablename(unsigned long arg)
 		 * space for at least the string size of variable name, or else
 		 * the name passed to UEFI may not be terminated as we expected.
 		 */
-		rv = copy_ucs2_from_user_len(&name,
+		rv = efi_runtime_call_name(call,
 				getnextvariablename.variable_name,
 				prev_name_size > name_string_size ?
 				prev_name_size : name_string_size);
@@ -491,57 +4725,52 @@ static long efi_runtime_get_nextvariablename(unsigned long arg)
 			return rv;
 	}
 
-	status = efi.get_next_variable(ns, name, vd);
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
-	if (put_user(status, getnextvariablename.status)) {
-		rv = -EFAULT;
-		goto out;
-	}
+	if (put_user(status, getnextvariablename.status))
+		return -EFAULT;
 
 	if (status != EFI_SUCCESS) {
 		if (status == EFI_BUFFER_TOO_SMALL) {
-			if (ns && put_user(*ns,
-				getnextvariablename.variable_name_size)) {
-				rv = -EFAULT;
-				goto out;
-			}
+			if (getnextvariablename.variable_name_size &&
+			    put_user(call->size,
+				getnextvariablename.variable_name_size))
+				return -EFAULT;
 		}
-		rv = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
-	if (name) {
+	if (call->name) {
 		if (copy_ucs2_to_user_len(getnextvariablename.variable_name,
-						name, prev_name_size)) {
-			rv = -EFAULT;
-			goto out;
-		}
+						call->name, prev_name_size))
+			return -EFAULT;
 	}
 
-	if (ns) {
-		if (put_user(*ns, getnextvariablename.variable_name_size)) {
-			rv = -EFAULT;
-			goto out;
-		}
+	if (getnextvariablename.variable_name_size) {
+		if (put_user(call->size,
+			     getnextvariablename.variable_name_size))
+			return -EFAULT;
 	}
 
-	if (vd) {
-		if (copy_to_user(getnextvariablename.vendor_guid, vd,
-							sizeof(efi_guid_t)))
-			rv = -EFAULT;
+	if (getnextvariablename.vendor_guid) {
+		if (copy_to_user(getnextvariablename.vendor_guid,
+				&call->vendor_guid, sizeof(efi_guid_t)))
+			return -EFAULT;
 	}
 
-out:
-	kfree(name);
-	return rv;
+	return 0;
 }
 
-static long efi_runtime_get_nexthighmonocount(unsigned long arg)
+static long efi_runtime_get_nexthighmonocount(struct efi_runtime_call *call,
+					      unsigned long arg)
 {
 	struct efi_getnexthighmonotoniccount __user *getnexthighmonocount_user;
 	struct efi_getnexthighmonotoniccount getnexthighmonocount;
 	efi_status_t status;
-	u32 count;
+	int rv;
 
 	getnexthighmonocount_user = (struct
 			efi_getnexthighmonotoniccount __user *)arg;
@@ -551,8 +4780,13 @@ static long efi_runtime_get_nexthighmonocount(unsigned long arg)
 			   sizeof(getnexthighmonocount)))
 		return -EFAULT;
 
-	status = efi.get_next_high_mono_count(
-		getnexthighmonocount.high_count ? &count : NULL);
+	if (getnexthighmonocount.high_count)
+		call->args |= EFI_RUNTIME_ARG_COUNT;
+
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
 	if (put_user(status, getnexthighmonocount.status))
 		return -EFAULT;
@@ -561,43 +4795,52 @@ static long efi_runtime_get_nexthighmonocount(unsigned long arg)
 		return -EINVAL;
 
 	if (getnexthighmonocount.high_count &&
-	    put_user(count, getnexthighmonocount.high_count))
+	    put_user(call->high_count, getnexthighmonocount.high_count))
 		return -EFAULT;
 
 	return 0;
 }
 
-static long efi_runtime_reset_system(unsigned long arg)
+static long efi_runtime_reset_system(struct efi_runtime_call *call,
+				     unsigned long arg)
 {
 	struct efi_resetsystem __user *resetsystem_user;
 	struct efi_resetsystem resetsystem;
-	void *data = NULL;
+	void *data;
 
 	resetsystem_user = (struct efi_resetsystem __user *)arg;
 	if (copy_from_user(&resetsystem, resetsystem_user,
 						sizeof(resetsystem)))
 		return -EFAULT;
 	if (resetsystem.data_size != 0) {
-		data = memdup_user((void *)resetsystem.data,
-						resetsystem.data_size);
+		data = efi_runtime_call_buf_user(call,
+				(void __user *)resetsystem.data,
+				resetsystem.data_size);
 		if (IS_ERR(data))
 			return PTR_ERR(data);
+		call->data = data;
 	}
 
-	efi.reset_system(resetsystem.reset_type, resetsystem.status,
-				resetsystem.data_size, (efi_char16_t *)data);
+	call->reset_type = resetsystem.reset_type;
+	call->reset_status = resetsystem.status;
+	call->size = resetsystem.data_size;
 
-	kfree(data);
-	return 0;
+	return efi_runtime_dispatch(call);
 }
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
-static long efi_runtime_query_variableinfo(unsigned long arg)
+/*
+ * Answered from the QueryVariableInfo cache when possible, unless 'fresh'
+ * asks for firmware to be entered.
+ */
+static long efi_runtime_query_variableinfo(struct efi_runtime_call *call,
+					   unsigned long arg, bool fresh)
 {
 	struct efi_queryvariableinfo __user *queryvariableinfo_user;
 	struct efi_queryvariableinfo queryvariableinfo;
 	efi_status_t status;
-	u64 max_storage, remaining, max_size;
+	u64 gen;
+	int rv;
 
 	queryvariableinfo_user = (struct efi_queryvariableinfo __user *)arg;
 
@@ -605,8 +4848,17 @@ static long efi_runtime_query_variableinfo(unsigned long arg)
 			   sizeof(queryvariableinfo)))
 		return -EFAULT;
 
-	status = efi.query_variable_info(queryvariableinfo.attributes,
-					 &max_storage, &remaining, &max_size);
+	call->attributes = queryvariableinfo.attributes;
+
+	if (fresh || !efi_qvi_lookup(call)) {
+		gen = efi_qvi_generation();
+		rv = efi_runtime_dispatch(call);
+		if (rv)
+			return rv;
+		if (call->status == EFI_SUCCESS)
+			efi_qvi_store(call, gen);
+	}
+	status = call->status;
 
 	if (put_user(status, queryvariableinfo.status))
 		return -EFAULT;
@@ -614,39 +4866,45 @@ static long efi_runtime_query_variableinfo(unsigned long arg)
 	if (status != EFI_SUCCESS)
 		return -EINVAL;
 
-	if (put_user(max_storage,
+	if (put_user(call->max_storage,
 		     queryvariableinfo.maximum_variable_storage_size))
 		return -EFAULT;
 
-	if (put_user(remaining,
+	if (put_user(call->remaining,
 		     queryvariableinfo.remaining_variable_storage_size))
 		return -EFAULT;
 
-	if (put_user(max_size, queryvariableinfo.maximum_variable_size))
+	if (put_user(call->max_size, queryvariableinfo.maximum_variable_size))
 		return -EFAULT;
 
 	return 0;
 }
 
-static long efi_runtime_query_capsulecaps(unsigned long arg)
+static long efi_runtime_query_capsulecaps(struct efi_runtime_call *call,
+					  unsigned long arg)
 {
 	struct efi_querycapsulecapabilities __user *qcaps_user;
 	struct efi_querycapsulecapabilities qcaps;
 	efi_capsule_header_t *capsules;
 	efi_status_t status;
-	u64 max_size;
-	int i, reset_type;
-	int rv = 0;
+	size_t size;
+	int rv;
+	int i;
 
 	qcaps_user = (struct efi_querycapsulecapabilities __user *)arg;
 
 	if (copy_from_user(&qcaps, qcaps_user, sizeof(qcaps)))
 		return -EFAULT;
 
-	capsules = kcalloc(qcaps.capsule_count + 1,
-			   sizeof(efi_capsule_header_t), GFP_KERNEL);
-	if (!capsules)
-		return -ENOMEM;
+	if (qcaps.capsule_count >= SIZE_MAX / sizeof(efi_capsule_header_t))
+		return -E2BIG;
+	size = (qcaps.capsule_count + 1) * sizeof(efi_capsule_header_t);
+	capsules = efi_runtime_call_buf(call, size);
+	if (IS_ERR(capsules))
+		return PTR_ERR(capsules);
+	memset(capsules, 0, size);
+	call->data = capsules;
+	call->size = qcaps.capsule_count;
 
 	for (i = 0; i < qcaps.capsule_count; i++) {
 		efi_capsule_header_t *c;
@@ -655,103 +4913,172 @@ static long efi_runtime_query_capsulecaps(unsigned long arg)
 		 * obtain the address of the capsule as it resides in the
 		 * user space
 		 */
-		if (get_user(c, qcaps.capsule_header_array + i)) {
-			rv = -EFAULT;
-			goto out;
-		}
+		if (get_user(c, qcaps.capsule_header_array + i))
+			return -EFAULT;
 		if (copy_from_user(&capsules[i], c,
-				sizeof(efi_capsule_header_t))) {
-			rv = -EFAULT;
-			goto out;
-		}
+				sizeof(efi_capsule_header_t)))
+			return -EFAULT;
 	}
 
-	qcaps.capsule_header_array = &capsules;
+	rv = efi_runtime_dispatch(call);
+	if (rv)
+		return rv;
+	status = call->status;
 
-	status = efi.query_capsule_caps((efi_capsule_header_t **)
-					qcaps.capsule_header_array,
-					qcaps.capsule_count,
-					&max_size, &reset_type);
-
-	if (put_user(status, qcaps.status)) {
-		rv = -EFAULT;
-		goto out;
-	}
+	if (put_user(status, qcaps.status))
+		return -EFAULT;
 
-	if (status != EFI_SUCCESS) {
-		rv = -EINVAL;
-		goto out;
-	}
+	if (status != EFI_SUCCESS)
+		return -EINVAL;
 
-	if (put_user(max_size, qcaps.maximum_capsule_size)) {
-		rv = -EFAULT;
-		goto out;
-	}
+	if (put_user(call->max_size, qcaps.maximum_capsule_size))
+		return -EFAULT;
 
-	if (put_user(reset_type, qcaps.reset_type))
-		rv = -EFAULT;
+	if (put_user(call->reset_type, qcaps.reset_type))
+		return -EFAULT;
 
-out:
-	kfree(capsules);
-	return rv;
+	return 0;
 }
 #endif
 
-static long efi_runtime_ioctl(struct file *file, unsigned int cmd,
-							unsigned long arg)
+static long efi_runtime_call_ioctl(struct efi_runtime_call *call,
+				   unsigned long arg)
 {
-	switch (cmd) {
+	switch (call->cmd) {
 	case EFI_RUNTIME_GET_VARIABLE:
-		return efi_runtime_get_variable(arg);
+		return efi_runtime_get_variable(call, arg, false);
+
+	case EFI_RUNTIME_GET_VARIABLE_FRESH:
+		call->cmd = EFI_RUNTIME_GET_VARIABLE;
+		return efi_runtime_get_variable(call, arg, true);
 
 	case EFI_RUNTIME_SET_VARIABLE:
-		return efi_runtime_set_variable(arg);
+		return efi_runtime_set_variable(call, arg);
 
 	case EFI_RUNTIME_GET_TIME:
-		return efi_runtime_get_time(arg);
+		return efi_runtime_get_time(call, arg);
 
 	case EFI_RUNTIME_SET_TIME:
-		return efi_runtime_set_time(arg);
+		return efi_runtime_set_time(call, arg);
 
 	case EFI_RUNTIME_GET_WAKETIME:
-		return efi_runtime_get_waketime(arg);
+		return efi_runtime_get_waketime(call, arg);
 
 	case EFI_RUNTIME_SET_WAKETIME:
-		return efi_runtime_set_waketime(arg);
+		return efi_runtime_set_waketime(call, arg);
 
 	case EFI_RUNTIME_GET_NEXTVARIABLENAME:
-		return efi_runtime_get_nextvariablename(arg);
+		return efi_runtime_get_nextvariablename(call, arg);
 
 	case EFI_RUNTIME_GET_NEXTHIGHMONOTONICCOUNT:
-		return efi_runtime_get_nexthighmonocount(arg);
+		return efi_runtime_get_nexthighmonocount(call, arg);
 
 	case EFI_RUNTIME_RESET_SYSTEM:
-		return efi_runtime_reset_system(arg);
+		return efi_runtime_reset_system(call, arg);
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 1, 0)
 	case EFI_RUNTIME_QUERY_VARIABLEINFO:
-		return efi_runtime_query_variableinfo(arg);
+		return efi_runtime_query_variableinfo(call, arg, false);
+
+	case EFI_RUNTIME_QUERY_VARIABLEINFO_FRESH:
+		call->cmd = EFI_RUNTIME_QUERY_VARIABLEINFO;
+		return efi_runtime_query_variableinfo(call, arg, true);
 
 	case EFI_RUNTIME_QUERY_CAPSULECAPABILITIES:
-		return efi_runtime_query_capsulecaps(arg);
+		return efi_runtime_query_capsulecaps(call, arg);
 #endif
 	}
 
 	return -ENOTTY;
 }
 
+static long efi_runtime_ioctl(struct file *file, unsigned int cmd,
+							unsigned long arg)
+{
+	struct efi_runtime_file *priv = file->private_data;
+	struct efi_runtime_call *call;
+	long rv;
+
+	switch (cmd) {
+	case EFI_RUNTIME_TRACE_CTL:
+		return efi_runtime_trace_ctl(arg);
+
+	case EFI_RUNTIME_SET_SCHED:
+		return efi_runtime_set_sched(priv, arg);
+
+	case EFI_RUNTIME_GET_SCHED_STATS:
+		return efi_runtime_get_sched_stats(priv, arg);
+
+	case EFI_RUNTIME_SET_TIMEOUT:
+		return efi_runtime_set_timeout(priv, arg);
+
+	case EFI_RUNTIME_GET_EMU_LATENCY:
+	case EFI_RUNTIME_SET_EMU_LATENCY:
+		return efi_runtime_emu_latency(cmd, arg);
+
+	case EFI_RUNTIME_SET_DEFERRED:
+		return efi_runtime_set_deferred(priv, arg);
+
+	case EFI_RUNTIME_FLUSH:
+		return efi_runtime_flush(priv, arg);
+
+	case EFI_RUNTIME_WARMUP:
+		return efi_warmup_start();
+	}
+
+	call = efi_runtime_call_alloc(priv, cmd);
+	if (!call)
+		return -ENOMEM;
+
+	if (READ_ONCE(trace_enabled))
+		call->trace_start = ktime_get_ns();
+
+	rv = efi_runtime_call_ioctl(call, arg);
+
+	if (call->trace_start && rv != -ENOTTY)
+		efi_runtime_trace_commit(call, rv);
+	efi_runtime_call_put(call);
+
+	return rv;
+}
+
 static int efi_runtime_open(struct inode *inode, struct file *file)
 {
+	struct efi_runtime_file *priv;
+
 	/*
-	 * nothing special to do here
-	 * We do accept multiple open files at the same time as we
-	 * synchronize on the per call operation.
+	 * We do accept multiple open files at the same time; their calls
+	 * are queued per file and scheduled onto firmware one at a time.
 	 */
+	priv = kzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+
+	kref_init(&priv->ref);
+	priv->timeout_ms = READ_ONCE(call_timeout_ms);
+	priv->sched_class = EFI_RUNTIME_SCHED_NORMAL;
+	priv->sched_weight = 1;
+	INIT_LIST_HEAD(&priv->sched_queue);
+	INIT_LIST_HEAD(&priv->sched_active);
+	INIT_DELAYED_WORK(&priv->defer_work, efi_defer_work);
+
+	file->private_data = priv;
+
 	return 0;
 }
 
 static int efi_runtime_close(struct inode *inode, struct file *file)
 {
+	struct efi_runtime_file *priv = file->private_data;
+
+	/*
+	 * Buffered writes are written out now, without waiting for them:
+	 * they and the work hold the file until they have reached firmware.
+	 */
+	efi_defer_kick(priv, 0);
+
+	/* Calls abandoned by their callers may still hold the file */
+	efi_runtime_file_put(priv);
 	return 0;
 }
 
@@ -761,6 +5088,7 @@ static int efi_runtime_close(struct inode *inode, struct file *file)
 static const struct file_operations efi_runtime_fops = {
 	.owner		= THIS_MODULE,
 	.unlocked_ioctl	= efi_runtime_ioctl,
+	.read		= efi_runtime_read,
 	.open		= efi_runtime_open,
 	.release	= efi_runtime_close,
 	.llseek		= no_llseek,
@@ -774,28 +5102,100 @@ static struct miscdevice efi_runtime_dev = {
 
 static int __init efi_runtime_init(void)
 {
-	int ret;
-
-	if (!EFI_RUNTIME_ENABLED) {
+	int ret, i;
+
+	if (efi_runtime_emulated()) {
+		ret = efi_emu_init();
+		if (ret)
+			return ret;
+		efi_emu_latency_init();
+		efi_rt = &efi_emu_ops;
+	} else if (strcmp(backend, "firmware")) {
+		pr_err("efi_runtime: unknown backend %s\n", backend);
+		return -EINVAL;
+	} else if (!EFI_RUNTIME_ENABLED) {
 		pr_err("EFI runtime services not enabled.\n");
 		return -ENODEV;
+	} else {
+		efi_firmware_ops_init();
+	}
+
+	for (i = 0; i < EFI_SCHED_CLASSES; i++)
+		INIT_LIST_HEAD(&sched_active[i]);
+	efi_internal_file_init(&footprint_file);
+
+	ret = efi_warmup_init();
+	if (ret)
+		goto err_emu;
+
+	efi_runtime_call_cache = KMEM_CACHE(efi_runtime_call, 0);
+	if (!efi_runtime_call_cache) {
+		ret = -ENOMEM;
+		goto err_emu;
 	}
 
+	efi_runtime_wq = alloc_ordered_workqueue("efi_runtime", 0);
+	if (!efi_runtime_wq) {
+		ret = -ENOMEM;
+		goto err_cache;
+	}
+
+	efi_runtime_defer_wq = alloc_workqueue("efi_runtime_defer",
+					       WQ_UNBOUND, 0);
+	if (!efi_runtime_defer_wq) {
+		ret = -ENOMEM;
+		goto err_wq;
+	}
+
+	ret = efi_runtime_proc_init();
+	if (ret)
+		goto err_defer_wq;
+
 	ret = misc_register(&efi_runtime_dev);
 	if (ret) {
 		pr_err("efi_runtime: can't misc_register on minor=%d\n",
 			MISC_DYNAMIC_MINOR);
-		return ret;
+		goto err_proc;
 	}
 
+	if (warmup)
+		efi_warmup_start();
+
 	return 0;
+
+err_proc:
+	proc_remove(efi_runtime_proc);
+err_defer_wq:
+	destroy_workqueue(efi_runtime_defer_wq);
+err_wq:
+	destroy_workqueue(efi_runtime_wq);
+err_cache:
+	kmem_cache_destroy(efi_runtime_call_cache);
+err_emu:
+	efi_emu_exit();
+	return ret;
 }
 
 static void __exit efi_runtime_exit(void)
 {
 	misc_deregister(&efi_runtime_dev);
+	proc_remove(efi_runtime_proc);
+	efi_warmup_exit();
+	/* Waits for the writes of closed files, which need efi_runtime_wq */
+	destroy_workqueue(efi_runtime_defer_wq);
+	/* Waits for calls abandoned by their callers */
+	destroy_workqueue(efi_runtime_wq);
+	kmem_cache_destroy(efi_runtime_call_cache);
+	efi_footprint_exit();
+	efi_read_cache_free();
+	efi_runtime_trace_free();
+	efi_emu_exit();
 }
 
 module_init(efi_runtime_init);
 module_exit(efi_runtime_exit);
 
+#if defined(EFI_RUNTIME_KUNIT_TEST) || \
+	IS_ENABLED(CONFIG_EFI_RUNTIME_KUNIT_TEST)
+#include "efi_runtime_test.c"
+#endif
@@ -22,12 +22,60 @@
 #ifndef _EFI_RUNTIME_H_
 #define _EFI_RUNTIME_H_
 
+#ifdef __KERNEL__
 #include <linux/efi.h>
+#else
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Userspace mirrors of the firmware types from <linux/efi.h>, so tools can
+ * build against this header without the kernel's private headers.
+ */
+typedef __u16		efi_char16_t;
+typedef __u8		efi_bool_t;
+typedef unsigned long	efi_status_t;
+
+typedef struct {
+	__u8	b[16];
+} __attribute__((aligned(4))) efi_guid_t;
+
+typedef struct {
+	__u16	year;
+	__u8	month;
+	__u8	day;
+	__u8	hour;
+	__u8	minute;
+	__u8	second;
+	__u8	pad1;
+	__u32	nanosecond;
+	__s16	timezone;
+	__u8	daylight;
+	__u8	pad2;
+} efi_time_t;
+
+typedef struct {
+	__u32	resolution;
+	__u32	accuracy;
+	__u8	sets_to_zero;
+} efi_time_cap_t;
+
+typedef struct {
+	efi_guid_t	guid;
+	__u32		headersize;
+	__u32		flags;
+	__u32		imagesize;
+} efi_capsule_header_t;
+
+#ifndef __packed
+#define __packed	__attribute__((packed))
+#endif
+#endif /* __KERNEL__ */
 
 struct efi_getvariable {
 	efi_char16_t	*variable_name;
 	efi_guid_t	*vendor_guid;
-	u32		*attributes;
+	__u32		*attributes;
 	unsigned long	*data_size;
 	void		*data;
 	efi_status_t	*status;
@@ -36,7 +84,7 @@ struct efi_getvariable {
 struct efi_setvariable {
 	efi_char16_t	*variable_name;
 	efi_guid_t	*vendor_guid;
-	u32		attributes;
+	__u32		attributes;
 	unsigned long	data_size;
 	void		*data;
 	efi_status_t	*status;
@@ -50,10 +98,10 @@ struct efi_getnextvariablename {
 } __packed;
 
 struct efi_queryvariableinfo {
-	u32		attributes;
-	u64		*maximum_variable_storage_size;
-	u64		*remaining_variable_storage_size;
-	u64		*maximum_variable_size;
+	__u32		attributes;
+	__u64		*maximum_variable_storage_size;
+	__u64		*remaining_variable_storage_size;
+	__u64		*maximum_variable_size;
 	efi_status_t	*status;
 } __packed;
 
@@ -82,14 +130,14 @@ struct efi_setwakeuptime {
 } __packed;
 
 struct efi_getnexthighmonotoniccount {
-	u32		*high_count;
+	__u32		*high_count;
 	efi_status_t	*status;
 } __packed;
 
 struct efi_querycapsulecapabilities {
 	efi_capsule_header_t	**capsule_header_array;
 	unsigned long		capsule_count;
-	u64			*maximum_capsule_size;
+	__u64			*maximum_capsule_size;
 	int			*reset_type;
 	efi_status_t		*status;
 } __packed;
@@ -101,6 +149,142 @@ struct efi_resetsystem {
 	efi_char16_t		*data;
 } __packed;
 
+/*
+ * Optional arguments of a runtime-service call that were supplied by the
+ * caller, as recorded in struct efi_runtime_trace_record.args.
+ */
+#define EFI_RUNTIME_ARG_NAME		0x0001
+#define EFI_RUNTIME_ARG_GUID		0x0002
+#define EFI_RUNTIME_ARG_ATTR		0x0004
+#define EFI_RUNTIME_ARG_SIZE		0x0008
+#define EFI_RUNTIME_ARG_DATA		0x0010
+#define EFI_RUNTIME_ARG_TIME		0x0020
+#define EFI_RUNTIME_ARG_CAP		0x0040
+#define EFI_RUNTIME_ARG_ENABLED		0x0080
+#define EFI_RUNTIME_ARG_PENDING		0x0100
+#define EFI_RUNTIME_ARG_COUNT		0x0200
+
+struct efi_runtime_trace_ctl {
+	__u32		enable;
+	__u32		payload_max;
+	__u64		records;
+	__u64		dropped;
+} __packed;
+
+/* struct efi_runtime_trace_record.flags */
+#define EFI_RUNTIME_TRACE_DISPATCHED	0x0001	/* call entered firmware */
+#define EFI_RUNTIME_TRACE_TRUNCATED	0x0002	/* payload cut at payload_max */
+#define EFI_RUNTIME_TRACE_ANSWERED	0x0004	/* answered by the driver */
+
+/*
+ * One captured ioctl, as returned by read() on /dev/efi_runtime.  The
+ * record is followed by name_size bytes of UCS-2 variable name and
+ * payload_size bytes of input payload (variable data, time, capsule
+ * headers or reset data), and padded to 'size' bytes.
+ */
+struct efi_runtime_trace_record {
+	__u32		size;
+	__u32		cmd;
+	__u64		seq;
+	__u64		timestamp_ns;
+	__u64		duration_ns;
+	__u64		firmware_ns;
+	__u64		status;
+	__s32		ret;
+	__u16		cpu;
+	__u16		flags;
+	__u32		args;
+	__u32		attributes;
+	__u64		size_arg;
+	efi_guid_t	vendor_guid;
+	__u32		name_size;
+	__u32		payload_size;
+	__u32		payload_total;
+	__u32		reserved;
+};
+
+/*
+ * Scheduling classes for EFI_RUNTIME_SET_SCHED.  Classes are served in
+ * strict priority order, files within a class in proportion to weight.
+ * Only CAP_SYS_ADMIN may pick the critical class.
+ */
+#define EFI_RUNTIME_SCHED_CRITICAL	0
+#define EFI_RUNTIME_SCHED_NORMAL	1
+#define EFI_RUNTIME_SCHED_BULK		2
+
+struct efi_runtime_sched {
+	__u32		sched_class;
+	__u32		weight;
+} __packed;
+
+/*
+ * Per-file queue wait statistics.  wait_hist[0] counts waits under 1us
+ * and wait_hist[i] waits of [2^(i-1), 2^i) us, the last bucket open ended.
+ */
+struct efi_runtime_sched_stats {
+	__u32		sched_class;
+	__u32		weight;
+	__u64		calls;
+	__u64		queued;
+	__u64		wait_ns;
+	__u64		max_wait_ns;
+	__u64		wait_hist[24];
+} __packed;
+
+/*
+ * Latency model of the emulated backend.  cost[] is indexed by the ioctl
+ * number of the service minus one, GetVariable first.  Each call of a
+ * service takes base_us plus per_kb_us for every KiB of variable data or
+ * name it moves, plus jitter drawn from jitter_dist, plus spike_us in
+ * spike_permille of the calls.
+ */
+#define EFI_RUNTIME_EMU_SERVICES	11
+
+#define EFI_RUNTIME_JITTER_NONE		0
+#define EFI_RUNTIME_JITTER_UNIFORM	1	/* [0, jitter_us] */
+#define EFI_RUNTIME_JITTER_NORMAL	2	/* bell shaped on [0, jitter_us] */
+#define EFI_RUNTIME_JITTER_EXPONENTIAL	3	/* mean jitter_us */
+
+struct efi_runtime_emu_cost {
+	__u32		base_us;
+	__u32		per_kb_us;
+	__u32		jitter_us;
+	__u32		jitter_dist;
+	__u32		spike_permille;
+	__u32		spike_us;
+} __packed;
+
+/*
+ * SetVariable flash model: the per-byte cost of a write is scaled by
+ * write_amp_pct / 100, every gc_interval-th non-volatile write stalls
+ * for gc_us, and a store reclaim stalls for reclaim_us plus
+ * reclaim_per_kb_us for every KiB of live variables it moves.
+ */
+struct efi_runtime_emu_latency {
+	struct efi_runtime_emu_cost cost[EFI_RUNTIME_EMU_SERVICES];
+	__u32		write_amp_pct;
+	__u32		gc_interval;
+	__u32		gc_us;
+	__u32		reclaim_us;
+	__u32		reclaim_per_kb_us;
+	__u32		reserved;
+} __packed;
+
+/*
+ * Deferred write statistics of a file, returned by EFI_RUNTIME_FLUSH.
+ * writes / flushed is the coalescing ratio.
+ */
+struct efi_runtime_defer_stats {
+	__u32		window_ms;	/* 0 when not in deferred mode */
+	__u32		pending;	/* buffered writes not yet flushed */
+	__u64		writes;		/* SetVariable calls buffered */
+	__u64		coalesced;	/* buffered values replaced by a later write */
+	__u64		flushed;	/* buffered writes issued to firmware */
+	__u64		flush_errors;	/* of which failed */
+	__u64		passthrough;	/* writes not eligible for buffering */
+	__u64		read_hits;	/* GetVariable answered from the buffer */
+} __packed;
+
 /* ioctl calls that are permitted to the /dev/efi_runtime interface. */
 #define EFI_RUNTIME_GET_VARIABLE \
 	_IOWR('p', 0x01, struct efi_getvariable)
@@ -132,4 +316,47 @@ struct efi_resetsystem {
 #define EFI_RUNTIME_RESET_SYSTEM \
 	_IOW('p', 0x0B, struct efi_resetsystem)
 
+#define EFI_RUNTIME_TRACE_CTL \
+	_IOWR('p', 0x0C, struct efi_runtime_trace_ctl)
+
+#define EFI_RUNTIME_SET_SCHED \
+	_IOW('p', 0x0D, struct efi_runtime_sched)
+#define EFI_RUNTIME_GET_SCHED_STATS \
+	_IOR('p', 0x0E, struct efi_runtime_sched_stats)
+
+/* Per-file call deadline in ms, 0 to wait forever */
+#define EFI_RUNTIME_SET_TIMEOUT \
+	_IOW('p', 0x0F, __u32)
+
+/* Emulated backend only, ENODEV otherwise */
+#define EFI_RUNTIME_GET_EMU_LATENCY \
+	_IOR('p', 0x10, struct efi_runtime_emu_latency)
+#define EFI_RUNTIME_SET_EMU_LATENCY \
+	_IOW('p', 0x11, struct efi_runtime_emu_latency)
+
+/* QueryVariableInfo bypassing the driver's cache */
+#define EFI_RUNTIME_QUERY_VARIABLEINFO_FRESH \
+	_IOR('p', 0x12, struct efi_queryvariableinfo)
+
+/*
+ * Buffer this file's non-volatile writes for up to the given window in
+ * ms, 0 to write them through again.  Setting 0 and EFI_RUNTIME_FLUSH
+ * wait for the buffered writes until a signal or the file's deadline.
+ */
+#define EFI_RUNTIME_SET_DEFERRED \
+	_IOW('p', 0x13, __u32)
+#define EFI_RUNTIME_FLUSH \
+	_IOR('p', 0x14, struct efi_runtime_defer_stats)
+
+/*
+ * Start reading variables ahead into the driver's read cache, EBUSY if
+ * already running.  Progress is shown in /proc/efi_runtime/stats.
+ */
+#define EFI_RUNTIME_WARMUP \
+	_IO('p', 0x15)
+
+/* GetVariable bypassing the driver's read cache */
+#define EFI_RUNTIME_GET_VARIABLE_FRESH \
+	_IOWR('p', 0x16, struct efi_getvariable)
+
 #endif /* _EFI_RUNTIME_H_ */
@@ -0,0 +1,514 @@
+/*
+ * EFI Runtime driver - KUnit tests for the ucs2 user-copy helpers
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+/*
+ * This file is included by efi_runtime.c when the driver is built with
+ * CONFIG_EFI_RUNTIME_KUNIT_TEST, or out of tree with make KUNIT=1, so
+ * the static helpers can be reached.  The suite runs when the module is
+ * loaded; see README.
+ *
+ * Names are no longer copied in by copy_ucs2_from_user() and
+ * copy_ucs2_from_user_len(): efi_runtime_call_name() replaced both when
+ * call buffers became charged to the file, so it is what is tested and
+ * timed here, against memdup_user() as the baseline.
+ */
+
+#include <kunit/test.h>
+#include <linux/mman.h>
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 10, 0)
+#error "the efi_runtime KUnit tests need kunit_vm_mmap(), from Linux 6.10"
+#endif
+
+/*
+ * The user buffer: room for the largest payload, followed by an unmapped
+ * guard page.
+ */
+#define EFI_TEST_USER_SIZE	(SZ_1M + PAGE_SIZE)
+#define EFI_TEST_GUARD		(EFI_TEST_USER_SIZE - PAGE_SIZE)
+
+/* Name lengths, in characters without the NULL, and payload sizes */
+static const size_t efi_test_name_len[] = {
+	8, 64, 512, 4096, UCS2_STRSIZE_MAX / sizeof(efi_char16_t) - 1,
+};
+static const size_t efi_test_payload[] = {
+	64, SZ_4K, SZ_64K, SZ_1M,
+};
+
+/* Bytes moved per timed loop, which bounds the iterations */
+#define EFI_TEST_BENCH_BYTES	SZ_16M
+
+struct efi_test_ctx {
+	unsigned long		user;
+	efi_char16_t		*name;
+	struct efi_runtime_file	*file;
+};
+
+static u8 __user *efi_test_user(struct kunit *test, size_t off)
+{
+	struct efi_test_ctx *ctx = test->priv;
+
+	return (u8 __user *)(ctx->user + off);
+}
+
+/*
+ * Write a name of 'len' characters and its NULL to the user buffer at
+ * 'off'.  Without 'terminate' the NULL is left out.
+ */
+static efi_char16_t __user *efi_test_put_name(struct kunit *test, size_t off,
+					      size_t len, bool terminate)
+{
+	struct efi_test_ctx *ctx = test->priv;
+	size_t size = (len + terminate) * sizeof(efi_char16_t);
+
+	KUNIT_ASSERT_LE(test, off + size, (size_t)EFI_TEST_GUARD);
+	KUNIT_ASSERT_EQ(test, copy_to_user(efi_test_user(test, off),
+					   ctx->name + UCS2_STRSIZE_MAX /
+					   sizeof(efi_char16_t) - len,
+					   size), 0UL);
+
+	return (efi_char16_t __user *)efi_test_user(test, off);
+}
+
+static struct efi_runtime_call *efi_test_call(struct kunit *test)
+{
+	struct efi_test_ctx *ctx = test->priv;
+	struct efi_runtime_call *call;
+
+	call = efi_runtime_call_alloc(ctx->file, EFI_RUNTIME_GET_VARIABLE);
+	KUNIT_ASSERT_NOT_NULL(test, call);
+
+	return call;
+}
+
+static int efi_test_init(struct kunit *test)
+{
+	struct efi_test_ctx *ctx;
+	size_t i, n = UCS2_STRSIZE_MAX / sizeof(efi_char16_t);
+
+	/* The driver didn't come up, e.g. built in on a machine without UEFI */
+	if (!efi_runtime_call_cache)
+		kunit_skip(test, "efi_runtime is not initialized");
+
+	ctx = kunit_kzalloc(test, sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	/* efi_test_exit() runs even if this fails, and puts ctx->file */
+	test->priv = ctx;
+
+	ctx->user = kunit_vm_mmap(test, NULL, 0, EFI_TEST_USER_SIZE,
+				  PROT_READ | PROT_WRITE,
+				  MAP_ANONYMOUS | MAP_PRIVATE, 0);
+	if (IS_ERR_VALUE(ctx->user))
+		return (int)ctx->user;
+	if (!ctx->user)
+		return -ENOMEM;
+	if (vm_munmap(ctx->user + EFI_TEST_GUARD, PAGE_SIZE))
+		return -ENOMEM;
+
+	/*
+	 * A name of 'len' characters is the tail of this one, so every
+	 * name in a test is terminated at the same place.
+	 */
+	ctx->name = kunit_kmalloc_array(test, n + 1, sizeof(efi_char16_t),
+					GFP_KERNEL);
+	if (!ctx->name)
+		return -ENOMEM;
+	for (i = 0; i < n; i++)
+		ctx->name[i] = 'A' + i % 26;
+	ctx->name[n] = 0;
+
+	ctx->file = kzalloc(sizeof(*ctx->file), GFP_KERNEL);
+	if (!ctx->file)
+		return -ENOMEM;
+	kref_init(&ctx->file->ref);
+	atomic_long_set(&ctx->file->mem_used, 0);
+
+	return 0;
+}
+
+static void efi_test_exit(struct kunit *test)
+{
+	struct efi_test_ctx *ctx = test->priv;
+
+	if (ctx && ctx->file) {
+		KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->file->mem_used),
+				0L);
+		efi_runtime_file_put(ctx->file);
+	}
+}
+
+static void efi_test_strsize(struct kunit *test)
+{
+	efi_char16_t __user *name;
+	size_t len;
+
+	name = efi_test_put_name(test, 0, 0, true);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name), sizeof(efi_char16_t));
+
+	name = efi_test_put_name(test, 0, 8, true);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name),
+			9 * sizeof(efi_char16_t));
+	KUNIT_EXPECT_EQ(test, get_ucs2_strsize_from_user(name, &len), 0);
+	KUNIT_EXPECT_EQ(test, len, 9 * sizeof(efi_char16_t));
+
+	/* Longer than a chunk */
+	name = efi_test_put_name(test, 0, 100, true);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name),
+			101 * sizeof(efi_char16_t));
+
+	/* The longest name accepted */
+	name = efi_test_put_name(test, 0,
+			UCS2_STRSIZE_MAX / sizeof(efi_char16_t) - 1, true);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name),
+			(size_t)UCS2_STRSIZE_MAX);
+}
+
+static void efi_test_strsize_null(struct kunit *test)
+{
+	size_t len = 1;
+
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(NULL), (size_t)0);
+	KUNIT_EXPECT_EQ(test, get_ucs2_strsize_from_user(NULL, &len),
+			-EFAULT);
+	KUNIT_EXPECT_EQ(test, len, (size_t)1);
+}
+
+static void efi_test_strsize_unterminated(struct kunit *test)
+{
+	efi_char16_t __user *name;
+	size_t len;
+
+	/* No NULL within UCS2_STRSIZE_MAX */
+	name = efi_test_put_name(test, 0,
+			UCS2_STRSIZE_MAX / sizeof(efi_char16_t), false);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name), (size_t)0);
+	KUNIT_EXPECT_EQ(test, get_ucs2_strsize_from_user(name, &len),
+			-EFAULT);
+
+	/* Running into the guard page */
+	name = efi_test_put_name(test, EFI_TEST_GUARD - 40, 20, false);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name), (size_t)0);
+}
+
+/* Names ending right before the guard page, at even and odd addresses */
+static void efi_test_strsize_guard(struct kunit *test)
+{
+	efi_char16_t __user *name;
+	size_t len;
+
+	for (len = 0; len < 3 * UCS2_CHUNK; len++) {
+		size_t size = (len + 1) * sizeof(efi_char16_t);
+
+		name = efi_test_put_name(test, EFI_TEST_GUARD - size, len,
+					 true);
+		KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name), size);
+
+		name = efi_test_put_name(test, EFI_TEST_GUARD - size - 1, len,
+					 true);
+		KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name), size);
+	}
+
+	/* A character straddling two mapped pages */
+	name = efi_test_put_name(test, PAGE_SIZE - 3, 4, true);
+	KUNIT_EXPECT_EQ(test, user_ucs2_strsize(name),
+			5 * sizeof(efi_char16_t));
+}
+
+static void efi_test_call_name(struct kunit *test)
+{
+	struct efi_runtime_call *call;
+	efi_char16_t __user *name;
+
+	name = efi_test_put_name(test, 0, 8, true);
+
+	/* Sized from the string */
+	call = efi_test_call(test);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 0), 0);
+	KUNIT_ASSERT_NOT_NULL(test, call->name);
+	KUNIT_EXPECT_EQ(test, efi_ucs2_size(call->name, SIZE_MAX),
+			9 * sizeof(efi_char16_t));
+	KUNIT_EXPECT_EQ(test, call->charged, 9 * sizeof(efi_char16_t));
+	efi_runtime_call_put(call);
+
+	/* A buffer larger than the string */
+	call = efi_test_call(test);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 32), 0);
+	efi_runtime_call_put(call);
+
+	/* name_size smaller than the string */
+	call = efi_test_call(test);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name,
+				8 * sizeof(efi_char16_t)), -EINVAL);
+	KUNIT_EXPECT_NULL(test, call->name);
+	efi_runtime_call_put(call);
+
+	/* Too short for one character */
+	call = efi_test_call(test);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 1), -EINVAL);
+	efi_runtime_call_put(call);
+}
+
+static void efi_test_call_name_fault(struct kunit *test)
+{
+	struct efi_runtime_call *call;
+	efi_char16_t __user *name;
+
+	call = efi_test_call(test);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, NULL, 0), -EFAULT);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, NULL, 16), -EFAULT);
+
+	/* Unterminated */
+	name = efi_test_put_name(test, EFI_TEST_GUARD - 40, 20, false);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 0), -EFAULT);
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 40), -EINVAL);
+
+	/* A buffer running into the guard page */
+	KUNIT_EXPECT_EQ(test, efi_runtime_call_name(call, name, 80), -EFAULT);
+	KUNIT_EXPECT_NULL(test, call->name);
+	efi_runtime_call_put(call);
+}
+
+static void efi_test_to_user(struct kunit *test)
+{
+	struct efi_test_ctx *ctx = test->priv;
+	efi_char16_t __user *dst;
+	efi_char16_t buf[9];
+
+	dst = (efi_char16_t __user *)efi_test_user(test, 0);
+	KUNIT_EXPECT_EQ(test, copy_ucs2_to_user_len(dst, ctx->name,
+						    sizeof(buf)), 0);
+	KUNIT_ASSERT_EQ(test, copy_from_user(buf, dst, sizeof(buf)), 0UL);
+	KUNIT_EXPECT_MEMEQ(test, buf, ctx->name, sizeof(buf));
+
+	/* Nothing to copy */
+	KUNIT_EXPECT_EQ(test, copy_ucs2_to_user_len(NULL, NULL, 16), 0);
+
+	KUNIT_EXPECT_EQ(test, copy_ucs2_to_user_len(NULL, ctx->name, 16),
+			-EFAULT);
+
+	dst = (efi_char16_t __user *)efi_test_user(test, EFI_TEST_GUARD - 8);
+	KUNIT_EXPECT_EQ(test, copy_ucs2_to_user_len(dst, ctx->name, 16),
+			-EFAULT);
+}
+
+static void efi_test_ucs2_size(struct kunit *test)
+{
+	static const efi_char16_t name[] = { 'B', 'o', 'o', 't', 0, 'X' };
+
+	KUNIT_EXPECT_EQ(test, efi_ucs2_size(name, SIZE_MAX),
+			5 * sizeof(efi_char16_t));
+	KUNIT_EXPECT_EQ(test, efi_ucs2_size(name, 6), (size_t)6);
+	KUNIT_EXPECT_EQ(test, efi_ucs2_size(name, 7), (size_t)6);
+	KUNIT_EXPECT_EQ(test, efi_ucs2_size(name, 1), (size_t)0);
+}
+
+/*
+ * Benchmarks.  Each loop runs until it has moved EFI_TEST_BENCH_BYTES,
+ * and the mean time per call is reported.
+ */
+
+static unsigned int efi_test_iters(size_t bytes)
+{
+	return clamp_t(size_t, EFI_TEST_BENCH_BYTES / max_t(size_t, bytes, 1),
+		       16, 100000);
+}
+
+static void efi_test_report(struct kunit *test, const char *what,
+			    size_t bytes, unsigned int iters, u64 ns)
+{
+	kunit_info(test, "%-20s %8zu bytes: %8llu ns/call, %6llu MB/s\n",
+		   what, bytes, div_u64(ns, iters),
+		   ns ? div64_u64((u64)bytes * iters * 1000, ns) : 0);
+}
+
+/*
+ * user_ucs2_strsize() as it was before it read names in chunks: one
+ * get_user() per character, with no length limit.
+ */
+static size_t efi_test_strsize_bytewise(efi_char16_t __user *str)
+{
+	efi_char16_t __user *s = str;
+	efi_char16_t c;
+	size_t len = sizeof(efi_char16_t);
+
+	if (get_user(c, s++))
+		return 0;
+
+	while (c != 0) {
+		if (get_user(c, s++))
+			return 0;
+		len += sizeof(efi_char16_t);
+	}
+	return len;
+}
+
+static void efi_test_bench_strsize(struct kunit *test)
+{
+	efi_char16_t __user *name;
+	unsigned int i, iters, n;
+	size_t size, sum;
+	u64 start;
+
+	for (n = 0; n < ARRAY_SIZE(efi_test_name_len); n++) {
+		name = efi_test_put_name(test, 0, efi_test_name_len[n], true);
+		size = (efi_test_name_len[n] + 1) * sizeof(efi_char16_t);
+		iters = efi_test_iters(size);
+
+		sum = 0;
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+			sum += efi_test_strsize_bytewise(name);
+		efi_test_report(test, "strsize per char", size, iters,
+				ktime_get_ns() - start);
+		KUNIT_EXPECT_EQ(test, sum, size * iters);
+
+		sum = 0;
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+			sum += user_ucs2_strsize(name);
+		efi_test_report(test, "user_ucs2_strsize", size, iters,
+				ktime_get_ns() - start);
+		KUNIT_EXPECT_EQ(test, sum, size * iters);
+
+		cond_resched();
+	}
+}
+
+static void efi_test_bench_call_name(struct kunit *test)
+{
+	struct efi_runtime_call *call;
+	efi_char16_t __user *name;
+	unsigned int i, iters, n;
+	size_t size;
+	void *buf;
+	u64 start;
+
+	for (n = 0; n < ARRAY_SIZE(efi_test_name_len); n++) {
+		name = efi_test_put_name(test, 0, efi_test_name_len[n], true);
+		size = (efi_test_name_len[n] + 1) * sizeof(efi_char16_t);
+		iters = efi_test_iters(size);
+
+		/* What the ioctls did before names were charged and checked */
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++) {
+			buf = memdup_user(name, size);
+			KUNIT_ASSERT_FALSE(test, IS_ERR(buf));
+			kfree(buf);
+		}
+		efi_test_report(test, "memdup_user", size, iters,
+				ktime_get_ns() - start);
+
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++) {
+			call = efi_test_call(test);
+			KUNIT_ASSERT_EQ(test,
+					efi_runtime_call_name(call, name, size),
+					0);
+			efi_runtime_call_put(call);
+		}
+		efi_test_report(test, "call_name sized", size, iters,
+				ktime_get_ns() - start);
+
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++) {
+			call = efi_test_call(test);
+			KUNIT_ASSERT_EQ(test,
+					efi_runtime_call_name(call, name, 0),
+					0);
+			efi_runtime_call_put(call);
+		}
+		efi_test_report(test, "call_name unsized", size, iters,
+				ktime_get_ns() - start);
+
+		cond_resched();
+	}
+}
+
+static void efi_test_bench_payload(struct kunit *test)
+{
+	struct efi_test_ctx *ctx = test->priv;
+	struct efi_runtime_call *call;
+	unsigned int i, iters, n;
+	u8 __user *user = efi_test_user(test, 0);
+	size_t size;
+	void *buf;
+	u64 start;
+
+	for (n = 0; n < ARRAY_SIZE(efi_test_payload); n++) {
+		size = efi_test_payload[n];
+		if (size > efi_runtime_payload_max())
+			break;
+		iters = efi_test_iters(size);
+
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++) {
+			call = efi_test_call(test);
+			buf = efi_runtime_call_buf_user(call, user, size);
+			KUNIT_ASSERT_FALSE(test, IS_ERR(buf));
+			call->data = buf;
+			efi_runtime_call_put(call);
+		}
+		efi_test_report(test, "call_buf_user", size, iters,
+				ktime_get_ns() - start);
+
+		buf = kvmalloc(size, GFP_KERNEL);
+		KUNIT_ASSERT_NOT_NULL(test, buf);
+		memset(buf, 0, size);
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+			KUNIT_ASSERT_EQ(test,
+					copy_ucs2_to_user_len(
+						(efi_char16_t __user *)user,
+						buf, size), 0);
+		efi_test_report(test, "copy_ucs2_to_user_len", size, iters,
+				ktime_get_ns() - start);
+		kvfree(buf);
+
+		cond_resched();
+	}
+
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&ctx->file->mem_used), 0L);
+}
+
+static struct kunit_case efi_runtime_test_cases[] = {
+	KUNIT_CASE(efi_test_strsize),
+	KUNIT_CASE(efi_test_strsize_null),
+	KUNIT_CASE(efi_test_strsize_unterminated),
+	KUNIT_CASE(efi_test_strsize_guard),
+	KUNIT_CASE(efi_test_call_name),
+	KUNIT_CASE(efi_test_call_name_fault),
+	KUNIT_CASE(efi_test_to_user),
+	KUNIT_CASE(efi_test_ucs2_size),
+	KUNIT_CASE_SLOW(efi_test_bench_strsize),
+	KUNIT_CASE_SLOW(efi_test_bench_call_name),
+	KUNIT_CASE_SLOW(efi_test_bench_payload),
+	{}
+};
+
+static struct kunit_suite efi_runtime_test_suite = {
+	.name = "efi_runtime",
+	.init = efi_test_init,
+	.exit = efi_test_exit,
+	.test_cases = efi_runtime_test_cases,
+};
+
+kunit_test_suite(efi_runtime_test_suite);
@@ -0,0 +1,571 @@
+/*
+ * efi_runtime_replay - re-issue a captured call trace through /dev/efi_runtime
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include "efi_runtime_tracefile.h"
+
+#define NR_CMDS		0x10
+
+struct latency {
+	__u64		*ns;
+	size_t		nr;
+	size_t		alloc;
+};
+
+struct cmd_stats {
+	unsigned int	cmd;
+	struct latency	recorded;
+	struct latency	replayed;
+	size_t		status_mismatch;
+	size_t		errors;
+};
+
+static struct cmd_stats stats[NR_CMDS];
+static size_t skipped_writes, skipped_other;
+
+/* Statistics of 'cmd', NULL for a command past the table */
+static struct cmd_stats *cmd_stats(unsigned int cmd)
+{
+	unsigned int nr = _IOC_NR(cmd);
+
+	return nr < NR_CMDS ? &stats[nr] : NULL;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: efi_runtime_replay [-D device] [-m] [-w] [-l loops] file\n"
+		"\n"
+		"  -m        replay at maximum speed instead of recorded pacing\n"
+		"  -w        also replay SetVariable, SetTime and SetWakeupTime\n"
+		"  -l loops  replay the trace 'loops' times (default 1)\n"
+		"  -D device device node (default " EFI_RUNTIME_DEVICE ")\n"
+		"\n"
+		"ResetSystem and calls that never reached firmware are not "
+		"replayed.\n");
+	exit(EXIT_FAILURE);
+}
+
+static __u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(__u64 ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+static void latency_add(struct latency *l, __u64 ns)
+{
+	if (l->nr == l->alloc) {
+		size_t alloc = l->alloc ? 2 * l->alloc : 256;
+		__u64 *p = realloc(l->ns, alloc * sizeof(*p));
+
+		if (!p) {
+			perror("realloc");
+			exit(EXIT_FAILURE);
+		}
+		l->ns = p;
+		l->alloc = alloc;
+	}
+	l->ns[l->nr++] = ns;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_seq(const void *a, const void *b)
+{
+	const struct efi_runtime_trace_record *x =
+		*(const struct efi_runtime_trace_record * const *)a;
+	const struct efi_runtime_trace_record *y =
+		*(const struct efi_runtime_trace_record * const *)b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static __u64 percentile(const struct latency *l, unsigned int pct)
+{
+	size_t i;
+
+	if (!l->nr)
+		return 0;
+	i = (l->nr * pct + 99) / 100;
+	return l->ns[i ? i - 1 : 0];
+}
+
+static double mean(const struct latency *l)
+{
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < l->nr; i++)
+		sum += l->ns[i];
+	return l->nr ? sum / l->nr : 0;
+}
+
+static char *load(const char *path, size_t *size)
+{
+	struct stat st;
+	char *buf;
+	FILE *in;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror(path);
+		return NULL;
+	}
+	if (fstat(fileno(in), &st)) {
+		perror(path);
+		fclose(in);
+		return NULL;
+	}
+	buf = malloc(st.st_size ? st.st_size : 1);
+	if (!buf || fread(buf, 1, st.st_size, in) != (size_t)st.st_size) {
+		perror(path);
+		free(buf);
+		fclose(in);
+		return NULL;
+	}
+	fclose(in);
+	*size = st.st_size;
+	return buf;
+}
+
+static size_t index_records(char *buf, size_t size,
+			    struct efi_runtime_trace_record ***out)
+{
+	const struct efi_runtime_tracefile_header *hdr = (void *)buf;
+	struct efi_runtime_trace_record **recs = NULL;
+	size_t off = sizeof(*hdr), nr = 0, alloc = 0;
+
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, EFI_RUNTIME_TRACEFILE_MAGIC,
+		   sizeof(EFI_RUNTIME_TRACEFILE_MAGIC)) ||
+	    hdr->version != EFI_RUNTIME_TRACEFILE_VERSION ||
+	    hdr->record_size != sizeof(struct efi_runtime_trace_record)) {
+		fprintf(stderr, "not a version %d trace file\n",
+			EFI_RUNTIME_TRACEFILE_VERSION);
+		return 0;
+	}
+
+	while (off + sizeof(**recs) <= size) {
+		struct efi_runtime_trace_record *rec = (void *)(buf + off);
+
+		if (rec->size < sizeof(*rec) || off + rec->size > size ||
+		    sizeof(*rec) + rec->name_size + rec->payload_size >
+		    rec->size) {
+			fprintf(stderr, "corrupt record at offset %zu\n", off);
+			break;
+		}
+		if (nr == alloc) {
+			alloc = alloc ? 2 * alloc : 1024;
+			recs = realloc(recs, alloc * sizeof(*recs));
+			if (!recs) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+		}
+		recs[nr++] = rec;
+		off += rec->size;
+	}
+
+	qsort(recs, nr, sizeof(*recs), cmp_seq);
+	*out = recs;
+	return nr;
+}
+
+/*
+ * Copy the recorded name into a buffer of at least 'min' bytes, so the
+ * replayed call sees the same buffer size the original caller passed.
+ */
+static efi_char16_t *replay_name(const struct efi_runtime_trace_record *rec,
+				 size_t min)
+{
+	size_t size = rec->name_size > min ? rec->name_size : min;
+	efi_char16_t *name;
+
+	name = calloc(1, size + sizeof(efi_char16_t));
+	if (name)
+		memcpy(name, efi_runtime_record_name(rec), rec->name_size);
+	return name;
+}
+
+static int writes_cmd(unsigned int cmd)
+{
+	return cmd == EFI_RUNTIME_SET_VARIABLE ||
+	       cmd == EFI_RUNTIME_SET_TIME ||
+	       cmd == EFI_RUNTIME_SET_WAKETIME;
+}
+
+/*
+ * Re-issue one record.  Arguments are built before the clock starts so
+ * the measured latency covers only the ioctl.  Returns 1 if the record was
+ * replayed and 0 if it was skipped.
+ */
+static int replay_one(int fd, const struct efi_runtime_trace_record *rec,
+		      int writes, __u64 *latency, efi_status_t *status)
+{
+	union {
+		struct efi_getvariable		getvariable;
+		struct efi_setvariable		setvariable;
+		struct efi_getnextvariablename	getnext;
+		struct efi_queryvariableinfo	qvi;
+		struct efi_gettime		gettime;
+		struct efi_settime		settime;
+		struct efi_getwakeuptime	getwake;
+		struct efi_setwakeuptime	setwake;
+		struct efi_getnexthighmonotoniccount mono;
+		struct efi_querycapsulecapabilities qcaps;
+	} u;
+	const void *payload = efi_runtime_record_payload(rec);
+	efi_capsule_header_t **capsules = NULL;
+	efi_guid_t guid = rec->vendor_guid;
+	efi_char16_t *name = NULL;
+	unsigned long size = rec->size_arg;
+	efi_bool_t enabled, pending;
+	efi_time_cap_t cap;
+	efi_time_t tm;
+	__u64 u1, u2, u3, start;
+	__u32 attr, count;
+	int reset_type;
+	void *data = NULL;
+	int ret = 0, rv;
+	size_t i;
+
+	memset(&u, 0, sizeof(u));
+
+	/* Calls the driver answered itself are replayed like the rest */
+	if (!(rec->flags & (EFI_RUNTIME_TRACE_DISPATCHED |
+			    EFI_RUNTIME_TRACE_ANSWERED)) ||
+	    (rec->flags & EFI_RUNTIME_TRACE_TRUNCATED) ||
+	    rec->cmd == EFI_RUNTIME_RESET_SYSTEM) {
+		skipped_other++;
+		return 0;
+	}
+	if (writes_cmd(rec->cmd) && !writes) {
+		skipped_writes++;
+		return 0;
+	}
+
+	if (rec->args & EFI_RUNTIME_ARG_NAME) {
+		name = replay_name(rec,
+			rec->cmd == EFI_RUNTIME_GET_NEXTVARIABLENAME ?
+			rec->size_arg : 0);
+		if (!name)
+			goto nomem;
+	}
+
+	switch (rec->cmd) {
+	case EFI_RUNTIME_GET_VARIABLE:
+		if (rec->args & EFI_RUNTIME_ARG_DATA) {
+			data = malloc(size ? size : 1);
+			if (!data)
+				goto nomem;
+		}
+		u.getvariable.variable_name = name;
+		u.getvariable.vendor_guid =
+			rec->args & EFI_RUNTIME_ARG_GUID ? &guid : NULL;
+		u.getvariable.attributes =
+			rec->args & EFI_RUNTIME_ARG_ATTR ? &attr : NULL;
+		u.getvariable.data_size =
+			rec->args & EFI_RUNTIME_ARG_SIZE ? &size : NULL;
+		u.getvariable.data = data;
+		u.getvariable.status = status;
+		break;
+
+	case EFI_RUNTIME_SET_VARIABLE:
+		u.setvariable.variable_name = name;
+		u.setvariable.vendor_guid = &guid;
+		u.setvariable.attributes = rec->attributes;
+		u.setvariable.data_size = rec->size_arg;
+		u.setvariable.data = (void *)payload;
+		u.setvariable.status = status;
+		break;
+
+	case EFI_RUNTIME_GET_NEXTVARIABLENAME:
+		u.getnext.variable_name_size =
+			rec->args & EFI_RUNTIME_ARG_SIZE ? &size : NULL;
+		u.getnext.variable_name = name;
+		u.getnext.vendor_guid =
+			rec->args & EFI_RUNTIME_ARG_GUID ? &guid : NULL;
+		u.getnext.status = status;
+		break;
+
+	case EFI_RUNTIME_QUERY_VARIABLEINFO:
+		u.qvi.attributes = rec->attributes;
+		u.qvi.maximum_variable_storage_size = &u1;
+		u.qvi.remaining_variable_storage_size = &u2;
+		u.qvi.maximum_variable_size = &u3;
+		u.qvi.status = status;
+		break;
+
+	case EFI_RUNTIME_GET_TIME:
+		u.gettime.time = rec->args & EFI_RUNTIME_ARG_TIME ? &tm : NULL;
+		u.gettime.capabilities =
+			rec->args & EFI_RUNTIME_ARG_CAP ? &cap : NULL;
+		u.gettime.status = status;
+		break;
+
+	case EFI_RUNTIME_SET_TIME:
+		memcpy(&tm, payload, sizeof(tm));
+		u.settime.time = &tm;
+		u.settime.status = status;
+		break;
+
+	case EFI_RUNTIME_GET_WAKETIME:
+		u.getwake.enabled =
+			rec->args & EFI_RUNTIME_ARG_ENABLED ? &enabled : NULL;
+		u.getwake.pending =
+			rec->args & EFI_RUNTIME_ARG_PENDING ? &pending : NULL;
+		u.getwake.time = rec->args & EFI_RUNTIME_ARG_TIME ? &tm : NULL;
+		u.getwake.status = status;
+		break;
+
+	case EFI_RUNTIME_SET_WAKETIME:
+		u.setwake.enabled = rec->attributes;
+		if (rec->args & EFI_RUNTIME_ARG_TIME) {
+			memcpy(&tm, payload, sizeof(tm));
+			u.setwake.time = &tm;
+		}
+		u.setwake.status = status;
+		break;
+
+	case EFI_RUNTIME_GET_NEXTHIGHMONOTONICCOUNT:
+		u.mono.high_count =
+			rec->args & EFI_RUNTIME_ARG_COUNT ? &count : NULL;
+		u.mono.status = status;
+		break;
+
+	case EFI_RUNTIME_QUERY_CAPSULECAPABILITIES:
+		capsules = calloc(rec->size_arg + 1, sizeof(*capsules));
+		if (!capsules)
+			goto nomem;
+		for (i = 0; i < rec->size_arg; i++)
+			capsules[i] = (efi_capsule_header_t *)payload + i;
+		u.qcaps.capsule_header_array = capsules;
+		u.qcaps.capsule_count = rec->size_arg;
+		u.qcaps.maximum_capsule_size = &u1;
+		u.qcaps.reset_type = &reset_type;
+		u.qcaps.status = status;
+		break;
+
+	default:
+		skipped_other++;
+		goto out;
+	}
+
+	start = now_ns();
+	rv = ioctl(fd, rec->cmd, &u);
+	*latency = now_ns() - start;
+	if (rv < 0 && errno != EINVAL && cmd_stats(rec->cmd))
+		cmd_stats(rec->cmd)->errors++;
+	ret = 1;
+out:
+	free(capsules);
+	free(data);
+	free(name);
+	return ret;
+
+nomem:
+	perror("malloc");
+	exit(EXIT_FAILURE);
+}
+
+static void report(__u64 recorded_span, __u64 replay_span, size_t replayed)
+{
+	struct latency all_rec = { 0 }, all_rep = { 0 };
+	unsigned int cmd;
+	size_t i;
+
+	printf("%-26s %8s %10s %10s %10s %10s %10s %8s\n", "call", "count",
+	       "mean(ns)", "p50(ns)", "p99(ns)", "max(ns)", "delta", "status");
+
+	for (cmd = 0; cmd < NR_CMDS; cmd++) {
+		struct cmd_stats *s = &stats[cmd];
+		double rec_mean, rep_mean;
+
+		if (!s->replayed.nr)
+			continue;
+
+		qsort(s->recorded.ns, s->recorded.nr, sizeof(__u64), cmp_u64);
+		qsort(s->replayed.ns, s->replayed.nr, sizeof(__u64), cmp_u64);
+		rec_mean = mean(&s->recorded);
+		rep_mean = mean(&s->replayed);
+
+		printf("%-26s %8zu %10.0f %10llu %10llu %10llu %9.1f%% %8zu\n",
+		       efi_runtime_cmd_name(s->cmd),
+		       s->replayed.nr, rep_mean,
+		       (unsigned long long)percentile(&s->replayed, 50),
+		       (unsigned long long)percentile(&s->replayed, 99),
+		       (unsigned long long)s->replayed.ns[s->replayed.nr - 1],
+		       rec_mean ? 100.0 * (rep_mean - rec_mean) / rec_mean : 0,
+		       s->status_mismatch);
+		printf("%-26s %8s %10.0f %10llu %10llu %10llu\n", "  (recorded)",
+		       "", rec_mean,
+		       (unsigned long long)percentile(&s->recorded, 50),
+		       (unsigned long long)percentile(&s->recorded, 99),
+		       (unsigned long long)s->recorded.ns[s->recorded.nr - 1]);
+		if (s->errors)
+			printf("%-26s %8zu ioctl errors\n", "", s->errors);
+
+		for (i = 0; i < s->replayed.nr; i++) {
+			latency_add(&all_rec, s->recorded.ns[i]);
+			latency_add(&all_rep, s->replayed.ns[i]);
+		}
+	}
+
+	qsort(all_rec.ns, all_rec.nr, sizeof(__u64), cmp_u64);
+	qsort(all_rep.ns, all_rep.nr, sizeof(__u64), cmp_u64);
+
+	printf("\nreplayed %zu calls, skipped %zu writes and %zu other\n",
+	       replayed, skipped_writes, skipped_other);
+	if (recorded_span && replay_span)
+		printf("throughput: recorded %.1f calls/s, replayed %.1f "
+		       "calls/s\n",
+		       replayed * 1e9 / recorded_span,
+		       replayed * 1e9 / replay_span);
+	printf("latency p50: recorded %lluns, replayed %lluns\n",
+	       (unsigned long long)percentile(&all_rec, 50),
+	       (unsigned long long)percentile(&all_rep, 50));
+	printf("latency p99: recorded %lluns, replayed %lluns\n",
+	       (unsigned long long)percentile(&all_rec, 99),
+	       (unsigned long long)percentile(&all_rep, 99));
+
+	free(all_rec.ns);
+	free(all_rep.ns);
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = EFI_RUNTIME_DEVICE;
+	struct efi_runtime_trace_record **recs;
+	__u64 first, recorded_span = 0, replay_start, replay_span;
+	unsigned int loops = 1, loop;
+	int max_speed = 0, writes = 0;
+	size_t size, nr, i, replayed = 0;
+	char *buf;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "D:mwl:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'm':
+			max_speed = 1;
+			break;
+		case 'w':
+			writes = 1;
+			break;
+		case 'l':
+			loops = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1 || !loops)
+		usage();
+
+	buf = load(argv[optind], &size);
+	if (!buf)
+		return EXIT_FAILURE;
+	nr = index_records(buf, size, &recs);
+	if (!nr) {
+		fprintf(stderr, "%s: no records\n", argv[optind]);
+		return EXIT_FAILURE;
+	}
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return EXIT_FAILURE;
+	}
+
+	first = recs[0]->timestamp_ns;
+	replay_start = now_ns();
+
+	for (loop = 0; loop < loops; loop++) {
+		__u64 loop_start = now_ns();
+
+		for (i = 0; i < nr; i++) {
+			const struct efi_runtime_trace_record *rec = recs[i];
+			struct cmd_stats *s = cmd_stats(rec->cmd);
+			efi_status_t status = 0;
+			__u64 latency;
+
+			if (!s) {
+				skipped_other++;
+				continue;
+			}
+
+			if (!max_speed)
+				sleep_until(loop_start +
+					    (rec->timestamp_ns - first));
+
+			if (!replay_one(fd, rec, writes, &latency, &status))
+				continue;
+
+			s->cmd = rec->cmd;
+			latency_add(&s->recorded, rec->duration_ns);
+			latency_add(&s->replayed, latency);
+			if (status != rec->status)
+				s->status_mismatch++;
+			replayed++;
+		}
+		recorded_span += recs[nr - 1]->timestamp_ns +
+				 recs[nr - 1]->duration_ns - first;
+	}
+
+	replay_span = now_ns() - replay_start;
+	close(fd);
+
+	report(recorded_span, replay_span, replayed);
+
+	free(recs);
+	free(buf);
+	return EXIT_SUCCESS;
+}
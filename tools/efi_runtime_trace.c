@@ -0,0 +1,322 @@
+/*
+ * efi_runtime_trace - capture calls made through /dev/efi_runtime
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "efi_runtime_tracefile.h"
+
+#define READ_BUF_SIZE	(1024 * 1024)
+
+static volatile sig_atomic_t stop;
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: efi_runtime_trace [-D device] [-t seconds] [-i ms] -o file\n"
+		"       efi_runtime_trace -p file\n"
+		"\n"
+		"  -o file     capture calls into 'file' until interrupted\n"
+		"  -t seconds  stop capturing after 'seconds'\n"
+		"  -i ms       poll interval while the rings are empty (default 10)\n"
+		"  -p file     print the records of a trace file\n"
+		"  -D device   device node (default " EFI_RUNTIME_DEVICE ")\n");
+	exit(EXIT_FAILURE);
+}
+
+static int trace_ctl(int fd, int enable, struct efi_runtime_trace_ctl *ctl)
+{
+	memset(ctl, 0, sizeof(*ctl));
+	ctl->enable = enable;
+	if (ioctl(fd, EFI_RUNTIME_TRACE_CTL, ctl) < 0) {
+		perror("EFI_RUNTIME_TRACE_CTL");
+		return -1;
+	}
+	return 0;
+}
+
+static ssize_t drain(int fd, FILE *out, char *buf, size_t size)
+{
+	ssize_t n;
+
+	n = read(fd, buf, size);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("read");
+		return -1;
+	}
+	if (n && fwrite(buf, 1, n, out) != (size_t)n) {
+		perror("write");
+		return -1;
+	}
+	return n;
+}
+
+static int record(const char *device, const char *path, unsigned int seconds,
+		  unsigned int interval_ms)
+{
+	struct efi_runtime_tracefile_header hdr;
+	struct efi_runtime_trace_ctl ctl;
+	struct timespec idle, now, end;
+	size_t bufsize;
+	ssize_t n;
+	FILE *out;
+	char *buf;
+	int fd, ret = EXIT_FAILURE;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		perror(device);
+		return EXIT_FAILURE;
+	}
+
+	out = fopen(path, "w");
+	if (!out) {
+		perror(path);
+		goto out_close;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, EFI_RUNTIME_TRACEFILE_MAGIC,
+	       sizeof(EFI_RUNTIME_TRACEFILE_MAGIC));
+	hdr.version = EFI_RUNTIME_TRACEFILE_VERSION;
+	hdr.record_size = sizeof(struct efi_runtime_trace_record);
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+		perror(path);
+		goto out_file;
+	}
+
+	if (trace_ctl(fd, 1, &ctl))
+		goto out_file;
+
+	bufsize = sizeof(struct efi_runtime_trace_record) +
+		  2 * (size_t)ctl.payload_max + 8;
+	if (bufsize < READ_BUF_SIZE)
+		bufsize = READ_BUF_SIZE;
+	buf = malloc(bufsize);
+	if (!buf) {
+		perror("malloc");
+		trace_ctl(fd, 0, &ctl);
+		goto out_file;
+	}
+
+	signal(SIGINT, handle_stop);
+	signal(SIGTERM, handle_stop);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	end.tv_sec += seconds;
+	idle.tv_sec = interval_ms / 1000;
+	idle.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+	while (!stop) {
+		n = drain(fd, out, buf, bufsize);
+		if (n < 0)
+			break;
+		if (seconds) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if (now.tv_sec > end.tv_sec ||
+			    (now.tv_sec == end.tv_sec &&
+			     now.tv_nsec >= end.tv_nsec))
+				break;
+		}
+		if (!n)
+			nanosleep(&idle, NULL);
+	}
+
+	if (!trace_ctl(fd, 0, &ctl)) {
+		/* Calls in flight at stop time commit shortly after */
+		nanosleep(&idle, NULL);
+		while ((n = drain(fd, out, buf, bufsize)) > 0)
+			;
+		if (!n) {
+			fprintf(stderr, "%llu calls captured, %llu dropped\n",
+				(unsigned long long)ctl.records,
+				(unsigned long long)ctl.dropped);
+			ret = EXIT_SUCCESS;
+		}
+	}
+
+	free(buf);
+out_file:
+	if (fclose(out)) {
+		perror(path);
+		ret = EXIT_FAILURE;
+	}
+out_close:
+	close(fd);
+	return ret;
+}
+
+static void print_name(const struct efi_runtime_trace_record *rec)
+{
+	const unsigned char *p = (const unsigned char *)
+				 efi_runtime_record_name(rec);
+	__u32 i;
+
+	for (i = 0; i + 1 < rec->name_size; i += 2) {
+		unsigned int c = p[i] | (p[i + 1] << 8);
+
+		if (!c)
+			break;
+		putchar(c < 0x20 || c > 0x7e ? '?' : c);
+	}
+}
+
+static void print_guid(const efi_guid_t *guid)
+{
+	const __u8 *b = guid->b;
+
+	printf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-"
+	       "%02x%02x%02x%02x%02x%02x",
+	       b[3], b[2], b[1], b[0], b[5], b[4], b[7], b[6],
+	       b[8], b[9], b[10], b[11], b[12], b[13], b[14], b[15]);
+}
+
+static int print(const char *path)
+{
+	struct efi_runtime_tracefile_header hdr;
+	struct efi_runtime_trace_record rec;
+	char *extra = NULL;
+	FILE *in;
+	int ret = EXIT_FAILURE;
+
+	in = fopen(path, "r");
+	if (!in) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+	    memcmp(hdr.magic, EFI_RUNTIME_TRACEFILE_MAGIC,
+		   sizeof(EFI_RUNTIME_TRACEFILE_MAGIC)) ||
+	    hdr.version != EFI_RUNTIME_TRACEFILE_VERSION ||
+	    hdr.record_size != sizeof(rec)) {
+		fprintf(stderr, "%s: not a version %d trace file\n", path,
+			EFI_RUNTIME_TRACEFILE_VERSION);
+		goto out;
+	}
+
+	for (;;) {
+		struct efi_runtime_trace_record *full;
+
+		if (fread(&rec, sizeof(rec), 1, in) != 1)
+			break;
+		if (rec.size < sizeof(rec)) {
+			fprintf(stderr, "%s: corrupt record\n", path);
+			goto out;
+		}
+		full = realloc(extra, rec.size);
+		if (!full) {
+			perror("realloc");
+			goto out;
+		}
+		extra = (char *)full;
+		memcpy(full, &rec, sizeof(rec));
+		if (fread(full + 1, rec.size - sizeof(rec), 1, in) != 1 &&
+		    rec.size > sizeof(rec)) {
+			fprintf(stderr, "%s: truncated record\n", path);
+			goto out;
+		}
+
+		printf("%8llu cpu%-3u %-26s status=0x%llx ret=%d "
+		       "total=%lluns fw=%lluns",
+		       (unsigned long long)full->seq, full->cpu,
+		       efi_runtime_cmd_name(full->cmd),
+		       (unsigned long long)full->status, full->ret,
+		       (unsigned long long)full->duration_ns,
+		       (unsigned long long)full->firmware_ns);
+		if (full->args & EFI_RUNTIME_ARG_NAME) {
+			printf(" name=");
+			print_name(full);
+		}
+		if (full->args & EFI_RUNTIME_ARG_GUID) {
+			printf(" guid=");
+			print_guid(&full->vendor_guid);
+		}
+		if (full->payload_total)
+			printf(" payload=%u%s", full->payload_total,
+			       full->flags & EFI_RUNTIME_TRACE_TRUNCATED ?
+			       "(truncated)" : "");
+		if (full->flags & EFI_RUNTIME_TRACE_ANSWERED)
+			printf(" (answered by driver)");
+		else if (!(full->flags & EFI_RUNTIME_TRACE_DISPATCHED))
+			printf(" (not dispatched)");
+		putchar('\n');
+	}
+
+	ret = EXIT_SUCCESS;
+out:
+	free(extra);
+	fclose(in);
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = EFI_RUNTIME_DEVICE;
+	const char *output = NULL, *input = NULL;
+	unsigned int seconds = 0, interval_ms = 10;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "D:o:p:t:i:")) != -1) {
+		switch (opt) {
+		case 'D':
+			device = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'p':
+			input = optarg;
+			break;
+		case 't':
+			seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			interval_ms = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+
+	if (!!output == !!input)
+		usage();
+
+	if (input)
+		return print(input);
+
+	return record(device, output, seconds, interval_ms);
+}
@@ -0,0 +1,83 @@
+/*
+ * EFI Runtime driver call trace file format
+ *
+ * Copyright(C) 2026 Canonical Ltd.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301,
+ *  USA.
+ */
+
+#ifndef _EFI_RUNTIME_TRACEFILE_H_
+#define _EFI_RUNTIME_TRACEFILE_H_
+
+#include "../src/efi_runtime.h"
+
+#define EFI_RUNTIME_DEVICE		"/dev/efi_runtime"
+
+/*
+ * A trace file is this header followed by the records exactly as read()
+ * returned them from /dev/efi_runtime.
+ */
+#define EFI_RUNTIME_TRACEFILE_MAGIC	"EFIRTRC"
+#define EFI_RUNTIME_TRACEFILE_VERSION	1
+
+struct efi_runtime_tracefile_header {
+	char		magic[8];
+	__u32		version;
+	__u32		record_size;
+} __packed;
+
+static inline const char *efi_runtime_cmd_name(unsigned int cmd)
+{
+	switch (cmd) {
+	case EFI_RUNTIME_GET_VARIABLE:
+		return "GetVariable";
+	case EFI_RUNTIME_SET_VARIABLE:
+		return "SetVariable";
+	case EFI_RUNTIME_GET_TIME:
+		return "GetTime";
+	case EFI_RUNTIME_SET_TIME:
+		return "SetTime";
+	case EFI_RUNTIME_GET_WAKETIME:
+		return "GetWakeupTime";
+	case EFI_RUNTIME_SET_WAKETIME:
+		return "SetWakeupTime";
+	case EFI_RUNTIME_GET_NEXTVARIABLENAME:
+		return "GetNextVariableName";
+	case EFI_RUNTIME_QUERY_VARIABLEINFO:
+		return "QueryVariableInfo";
+	case EFI_RUNTIME_GET_NEXTHIGHMONOTONICCOUNT:
+		return "GetNextHighMonotonicCount";
+	case EFI_RUNTIME_QUERY_CAPSULECAPABILITIES:
+		return "QueryCapsuleCapabilities";
+	case EFI_RUNTIME_RESET_SYSTEM:
+		return "ResetSystem";
+	}
+	return "Unknown";
+}
+
+static inline const char *
+efi_runtime_record_name(const struct efi_runtime_trace_record *rec)
+{
+	return (const char *)(rec + 1);
+}
+
+static inline const void *
+efi_runtime_record_payload(const struct efi_runtime_trace_record *rec)
+{
+	return (const char *)(rec + 1) + rec->name_size;
+}
+
+#endif /* _EFI_RUNTIME_TRACEFILE_H_ */